@@ -23,8 +23,11 @@
 #define PICO_TELNETD_H 1
 
 #include "pico/stdio.h"
+#include "pico/async_context.h"
 #include "lwip/tcp.h"
 #include "pico_telnetd/ringbuffer.h"
+#include "pico_telnetd/lineedit.h"
+#include "pico_telnetd/screen.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -44,7 +47,9 @@ typedef struct user_pwhash_entry {
 
 typedef enum tcp_server_mode {
 	RAW_MODE = 0,
+#ifndef TELNETD_NO_TELNET_MODE
 	TELNET_MODE
+#endif
 } tcp_server_mode_t;
 
 typedef enum tcp_connection_state {
@@ -53,48 +58,237 @@ typedef enum tcp_connection_state {
 	CS_AUTH_LOGIN,
 	CS_AUTH_PASSWD,
 	CS_CONNECT,
+	CS_DETACHED,       /* Connection lost, session kept for resume_grace seconds */
 } tcp_connection_state_t;
 
-typedef struct tcp_server_t {
-	struct tcp_pcb *listen;
+typedef enum tcp_notify_mode {
+	NOTIFY_ALWAYS = 0, /* Notify on every received segment */
+	NOTIFY_EDGE,       /* Notify only when input buffer transitions from empty */
+	NOTIFY_LINE,       /* Notify when line terminator is received (or notify_timeout expires) */
+	NOTIFY_THRESHOLD,  /* Notify when notify_threshold bytes available (or notify_timeout expires) */
+} tcp_notify_mode_t;
+
+typedef enum tcp_nagle_mode {
+	NAGLE_AUTO = 0,    /* Disable Nagle for interactive traffic, enable for bulk output */
+	NAGLE_ENABLED,     /* Always use Nagle algorithm (lwIP default) */
+	NAGLE_DISABLED,    /* Never use Nagle algorithm (TCP_NODELAY) */
+} tcp_nagle_mode_t;
+
+typedef enum tcp_overflow_mode {
+	OVERFLOW_DROP = 0, /* New output that does not fit in output buffer is dropped */
+	OVERFLOW_EVICT,    /* Oldest lines are dropped to make room, and replaced with "[N bytes dropped]" */
+} tcp_overflow_mode_t;
+
+typedef enum tcp_coalesce_mode {
+	COALESCE_NONE = 0, /* Send all queued output (default) */
+	COALESCE_CR,       /* Skip queued line rewrites (\r) that are superseded by a newer one */
+	COALESCE_CR_HOME,  /* Also skip queued screen redraws (starting with cursor home + erase) superseded by a newer one */
+} tcp_coalesce_mode_t;
+
+typedef enum tcp_takeover_mode {
+	TAKEOVER_NONE = 0, /* Reject new connections when all sessions are in use */
+	TAKEOVER_STALE,    /* Replace session that looks dead (repeated retransmissions, or idle for takeover_idle) */
+	TAKEOVER_OLDEST,   /* Replace session that has been idle longest */
+} tcp_takeover_mode_t;
+
+/* Output fragment for telnet_server_writev() (same layout as struct iovec) */
+typedef struct telnet_iovec {
+	const void *iov_base;
+	size_t iov_len;
+} telnet_iovec_t;
+
+#define TELNET_DEFAULT_MAX_SESSIONS 1
+
+/* Static allocation mode: server, sessions and buffers are reserved at compile time
+   and library does not use heap at all. Buffer sizes passed to telnet_server_init()
+   cannot exceed these. */
+#ifdef TELNETD_STATIC_ALLOC
+#ifndef TELNETD_STATIC_SESSIONS
+#define TELNETD_STATIC_SESSIONS TELNET_DEFAULT_MAX_SESSIONS
+#endif
+#ifndef TELNETD_STATIC_RXBUF_SIZE
+#define TELNETD_STATIC_RXBUF_SIZE 2048
+#endif
+#ifndef TELNETD_STATIC_TXBUF_SIZE
+#define TELNETD_STATIC_TXBUF_SIZE 2048
+#endif
+#ifndef TELNETD_STATIC_HISTORY_SIZE
+#define TELNETD_STATIC_HISTORY_SIZE 0
+#endif
+#ifndef TELNETD_STATIC_LINE_SIZE
+#define TELNETD_STATIC_LINE_SIZE 0
+#endif
+#ifndef TELNETD_STATIC_LINE_HISTORY
+#define TELNETD_STATIC_LINE_HISTORY 0
+#endif
+#endif
+
+struct tcp_server_t;
+
+#ifndef TELNETD_NO_AUTH
+/* Login name is only needed while authenticating, so it is kept in a small pool
+   of scratch buffers (see TELNET_MAX_CONCURRENT_LOGINS) instead of every session. */
+typedef struct telnet_auth {
+	struct telnet_session *owner;
+	uint32_t start;            /* Time (ms since boot) when connection was accepted */
+	uint8_t login[MAX_LOGIN_LENGTH + 1];
+} telnet_auth_t;
+#endif
+
+/* Per-connection state. Fields used in the receive path are kept together at the start of the struct. */
+typedef struct telnet_session {
 	struct tcp_pcb *client;
-	tcp_connection_state_t cstate;
-	telnet_ringbuffer_t rb_in;
-	telnet_ringbuffer_t rb_out;
-	int telnet_state;
+	struct tcp_server_t *server;
+	struct pbuf *rx_queue;     /* Received data not yet processed into rb_in */
+	uint8_t cstate;            /* tcp_connection_state_t */
+	uint8_t telnet_state;
 	uint8_t telnet_cmd;
 	uint8_t telnet_opt;
 	uint8_t telnet_prev;
-	bool banner_displayed;
-	uint32_t telnet_cmd_count;
-	uint16_t login_delay;
-	uint8_t login_failure_count;
-	uint8_t login[MAX_LOGIN_LENGTH + 1];
-	uint8_t passwd[MAX_PASSWORD_LENGTH + 1];
+	uint8_t telnet_cmd_count;  /* Telnet commands received (saturates at 255) */
+	bool in_recv : 1;          /* Inside tcp recv callback */
+	bool tx_pending : 1;       /* Data written with tcp_write() but not yet output */
+	bool work_pending : 1;     /* Input processing continues from server input_worker */
+	bool interactive : 1;      /* Current traffic classification (NAGLE_AUTO mode) */
+	bool flush_pending : 1;    /* Deferred flush scheduled (flush_worker) */
+	bool input_notified : 1;   /* chars_available_callback called since input buffer was empty */
+	bool line_received : 1;    /* Line terminator received since last notification */
+	bool notify_timer_armed : 1;
+	bool banner_displayed : 1;
+	bool negotiation_done : 1; /* Client has responded to telnet negotiation (or timed out) */
+	bool timer_set : 1;        /* timer_worker (re)scheduled */
+	bool replaying : 1;        /* Sending stdio history (rb_out is sent after it) */
+	bool at_line_start : 1;    /* Last byte sent from rb_out was CR or LF */
+	union {
+		/* Login state is only needed before session is connected... */
+		struct {
+			uint8_t login_failure_count;
+			uint16_t login_delay; /* Delay (ms) before login prompt is shown again after failure */
+		};
+		/* ...and output buffer is only used after that */
+		uint32_t drop_count;       /* Bytes dropped, reported by "[N bytes dropped]" marker at the start of rb_out (0 = no marker) */
+	};
+	uint32_t last_input_time;  /* Time (ms since boot) when client last sent data */
+	telnet_ringbuffer_t rb_in;
+	telnet_ringbuffer_t rb_out;
+
+	/* Rarely used state... */
+#ifndef TELNETD_NO_AUTH
+	telnet_auth_t *auth;       /* Login scratch buffer (only while authenticating) */
+#endif
+	uint32_t replay_pos;       /* Position in stdio history (see history_total) to send next */
+	void *user_data;           /* Free for application use */
+#ifndef TELNETD_NO_AUTH
+	uint64_t resume_token;     /* One-time token for resuming session (0 = none) */
+#endif
+	async_at_time_worker_t timer_worker;
+	async_at_time_worker_t flush_worker;
+} telnet_session_t;
+
+typedef struct tcp_server_t {
+	struct tcp_pcb *listen;
+	telnet_session_t *sessions; /* Session pool (allocated by telnet_server_init()) */
+	uint8_t max_sessions;
+	uint8_t read_next;         /* Session telnet_server_read() reads from first (round-robin) */
+	bool in_worker;
+#ifndef TELNETD_NO_AUTH
+	uint8_t auth_slots;
+	telnet_auth_t *auth_pool;  /* Login scratch buffers (allocated by telnet_server_start() if auth_cb is set) */
+	telnet_session_t *pending; /* Login slot for connection that takes over a session once logged in (takeover_mode) */
+#endif
+	async_when_pending_worker_t input_worker; /* Continues work that exceeded callback budget */
+	uint32_t work_start;       /* Start time (us) of current callback */
+	size_t work_bytes;         /* Bytes processed in current callback */
+	uint32_t max_callback_us;  /* Longest time (us) spent in a single callback */
+	telnet_ringbuffer_t history; /* Recent stdio output (allocated by telnet_server_start() if history_size is set) */
+	uint32_t history_total;    /* Total bytes written to history */
+#ifndef TELNETD_NO_LINEEDIT
+	telnet_lineedit_t *editors; /* Line editor for each session (allocated by telnet_server_start() if line_editor is set) */
+#endif
+	uint32_t rate_tokens;      /* Output rate limiter: bytes that can be sent now */
+	uint64_t rate_time;        /* Output rate limiter: time (us) of last refill */
+	uint64_t throttle_start;   /* Time (us) when output was last throttled */
+	bool rate_throttled;       /* Output is waiting for rate limiter */
+	uint32_t throttle_count;   /* Number of times output has been throttled */
+	uint32_t throttled_ms;     /* Total time (ms) output has been throttled */
+	uint32_t tx_dropped;       /* Output bytes dropped because output buffer was full (stdio, OVERFLOW_EVICT) */
+	uint32_t tx_coalesced;     /* Output bytes skipped as superseded by coalesce_mode */
 
 	/* Configuration options... set before calling telnet_server_start() */
 	uint16_t port;             /* Listen port (default is telnet port 23) */
 	tcp_server_mode_t mode;    /* Server mode: TELNET_MODE or RAW_MODE */
 	const char *banner;        /* Login banner string to display when connection starts. */
 	void (*log_cb)(int priority, const char *format, ...);
+#ifndef TELNETD_NO_AUTH
 	int (*auth_cb)(void* param, const char *login, const char *password);
 	void *auth_cb_param;
-	bool auto_flush;           /* Control flushing output buffer from tcp "poll" callback */
+#endif
+	bool auto_flush;           /* Flush output buffer periodically from tcp "poll" callback (default is true) */
+	bool rx_zero_copy;         /* Read received data directly from pbufs (no rb_in once connected) */
+	size_t history_size;       /* Size of stdio history (scrollback) sent to new clients, 0 = disabled (default) */
+	uint16_t line_editor;      /* Built-in line editor: max line length, 0 = disabled (default) */
+	uint16_t line_history;     /* Line editor history size (bytes per session) */
+	size_t work_budget_bytes;  /* Max bytes to process per callback, 0 = unlimited (default) */
+	uint32_t work_budget_us;   /* Max time (us) to spend per callback, 0 = unlimited (default) */
+	tcp_nagle_mode_t nagle_mode; /* Nagle algorithm policy (default is NAGLE_AUTO) */
+	tcp_overflow_mode_t overflow_mode; /* What to do when output buffer is full (default is OVERFLOW_DROP) */
+	tcp_coalesce_mode_t coalesce_mode; /* Skip superseded status line/screen updates in output buffer (default is COALESCE_NONE) */
+	uint16_t flush_delay;      /* Coalescing window (ms) for telnet_server_write() (default 2ms) */
+	uint32_t rate_limit;       /* Max output rate (bytes/s) for all sessions combined, 0 = unlimited (default) */
+	uint32_t rate_burst;       /* Max bytes sent at once when output has been idle (0 = rate_limit) */
+	tcp_notify_mode_t notify_mode; /* When to call stdio chars_available_callback (default NOTIFY_ALWAYS) */
+	uint16_t notify_threshold; /* Bytes needed to notify in NOTIFY_THRESHOLD mode */
+	uint16_t notify_timeout;   /* Notify anyway after this time (ms) in NOTIFY_LINE/NOTIFY_THRESHOLD modes */
+	uint16_t keepalive_idle;   /* TCP keepalive: idle time (s) before first probe, 0 = disabled (default) */
+	uint16_t keepalive_interval; /* TCP keepalive: time (s) between probes (0 = lwIP default) */
+	uint8_t keepalive_count;   /* TCP keepalive: unanswered probes before disconnect (0 = lwIP default) */
+	uint16_t idle_timeout;     /* Disconnect client after this many seconds without input, 0 = disabled (default) */
+	uint16_t login_timeout;    /* Disconnect client that has not logged in within this many seconds (default 60), 0 = disabled */
+	uint16_t resume_grace;     /* Keep authenticated session this long (s) after connection is lost, 0 = disabled (default) */
+	tcp_takeover_mode_t takeover_mode; /* What to do when connection arrives while all sessions are in use */
+	uint16_t takeover_idle;    /* Session idle this long (s) is considered stale (TAKEOVER_STALE) */
 	/* Call back to determine if incoming connection should be allowed */
 	int (*allow_connect_cb)(ip_addr_t *src_ip);
+	/* Session callbacks (called from lwIP context), cb_param is passed as first argument */
+	void *cb_param;
+	void (*on_connect)(void *param, telnet_session_t *session);
+	void (*on_data)(void *param, telnet_session_t *session, const uint8_t *data, size_t len);
+	void (*on_disconnect)(void *param, telnet_session_t *session);
 } tcp_server_t;
 
 
 
 tcp_server_t* telnet_server_init(size_t rxbuf_size, size_t tzbuf_set);
+tcp_server_t* telnet_server_init_sessions(size_t rxbuf_size, size_t txbuf_size, uint8_t max_sessions);
 bool telnet_server_start(tcp_server_t *server, bool stdio);
 void telnet_server_destroy(tcp_server_t *server);
 err_t telnet_server_flush_buffer(tcp_server_t *server);
+err_t telnet_server_write(tcp_server_t *server, const void *buf, size_t len);
+err_t telnet_server_writev(tcp_server_t *server, const telnet_iovec_t *iov, int iovcnt);
+int telnet_server_printf(tcp_server_t *server, const char *format, ...);
+int telnet_server_vprintf(tcp_server_t *server, const char *format, va_list ap);
+int telnet_server_read(tcp_server_t *server, void *buf, size_t len);
 bool telnet_server_client_connected(tcp_server_t *server);
 err_t telnet_server_get_client_ip(const tcp_server_t *server, ip_addr_t *ip, uint16_t *port);
 const char* tcp_connection_state_name(enum tcp_connection_state state);
 err_t telnet_server_disconnect_client(tcp_server_t *server);
 
+telnet_session_t* telnet_server_get_session(tcp_server_t *server, uint8_t index);
+err_t telnet_session_flush_buffer(telnet_session_t *session);
+err_t telnet_session_write(telnet_session_t *session, const void *buf, size_t len);
+err_t telnet_session_writev(telnet_session_t *session, const telnet_iovec_t *iov, int iovcnt);
+int telnet_session_printf(telnet_session_t *session, const char *format, ...);
+int telnet_session_vprintf(telnet_session_t *session, const char *format, va_list ap);
+int telnet_session_read(telnet_session_t *session, void *buf, size_t len);
+size_t telnet_session_peek(telnet_session_t *session, const uint8_t **ptr);
+void telnet_session_consume(telnet_session_t *session, size_t len);
+bool telnet_session_connected(telnet_session_t *session);
+err_t telnet_session_get_client_ip(const telnet_session_t *session, ip_addr_t *ip, uint16_t *port);
+err_t telnet_session_disconnect(telnet_session_t *session);
+#ifndef TELNETD_NO_SCREEN
+int telnet_session_render(telnet_session_t *session, telnet_screen_t *screen);
+#endif
+
 
 #ifdef __cplusplus
 }
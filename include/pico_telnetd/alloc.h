@@ -0,0 +1,63 @@
+/* alloc.h
+   Copyright (C) 2024 Timo Kokkonen <tjko@iki.fi>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+
+   This file is part of pico-telnetd Library.
+
+   pico-telnetd Library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   pico-telnetd Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with pico-telnetd Library. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PICO_TELNETD_ALLOC_H_
+#define _PICO_TELNETD_ALLOC_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/* Owner tags passed to allocator hooks */
+typedef enum telnetd_alloc_tag {
+	TELNETD_ALLOC_SERVER = 0,   /* tcp_server_t */
+	TELNETD_ALLOC_SESSIONS,     /* Session pool */
+	TELNETD_ALLOC_AUTH,         /* Login buffer pool */
+	TELNETD_ALLOC_RINGBUFFER,   /* Ringbuffer data */
+	TELNETD_ALLOC_LOG,          /* Log message buffer */
+	TELNETD_ALLOC_CRYPT,        /* sha256_crypt() / sha512_crypt() result buffer */
+	TELNETD_ALLOC_LINEEDIT,     /* Line editor buffers */
+	TELNETD_ALLOC_SCREEN,       /* Screen renderer cell buffers */
+} telnetd_alloc_tag_t;
+
+typedef struct telnetd_allocator {
+	/* Return block of (at least) size bytes aligned to align, or NULL. */
+	void* (*alloc)(void *ctx, size_t size, size_t align, telnetd_alloc_tag_t tag);
+	/* Release block, size and tag are same as when block was allocated. */
+	void (*free)(void *ctx, void *ptr, size_t size, telnetd_alloc_tag_t tag);
+	void *ctx;
+} telnetd_allocator_t;
+
+
+void telnetd_set_allocator(const telnetd_allocator_t *allocator);
+void* telnetd_alloc(size_t size, size_t align, telnetd_alloc_tag_t tag);
+void telnetd_free(void *ptr, size_t size, telnetd_alloc_tag_t tag);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PICO_TELNETD_ALLOC_H_ */
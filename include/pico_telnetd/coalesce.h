@@ -0,0 +1,42 @@
+/* coalesce.h
+   Copyright (C) 2024 Timo Kokkonen <tjko@iki.fi>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+
+   This file is part of pico-telnetd Library.
+
+   pico-telnetd Library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   pico-telnetd Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with pico-telnetd Library. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PICO_TELNETD_COALESCE_H
+#define PICO_TELNETD_COALESCE_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include "pico_telnetd/ringbuffer.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Helpers for finding superseded output in output buffer (see coalesce_mode). */
+size_t telnet_coalesce_cr_frame(telnet_ringbuffer_t *rb, size_t offset);
+int telnet_coalesce_find_home(telnet_ringbuffer_t *rb, size_t offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICO_TELNETD_COALESCE_H */
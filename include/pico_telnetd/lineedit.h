@@ -0,0 +1,66 @@
+/* lineedit.h
+   Copyright (C) 2024 Timo Kokkonen <tjko@iki.fi>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+
+   This file is part of pico-telnetd Library.
+
+   pico-telnetd Library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   pico-telnetd Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with pico-telnetd Library. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PICO_TELNETD_LINEEDIT_H
+#define PICO_TELNETD_LINEEDIT_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico_telnetd/ringbuffer.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Return values from telnet_lineedit_input() */
+#define TELNET_LINEEDIT_NONE 0  /* Character was handled by the editor */
+#define TELNET_LINEEDIT_LINE 1  /* Line is complete (see telnet_lineedit_accept()) */
+#define TELNET_LINEEDIT_PASS 2  /* Character should be passed to application as is */
+
+/* Output (echo) function, called with escape sequences needed to update the terminal. */
+typedef void (*telnet_lineedit_out_t)(void *ctx, const uint8_t *buf, size_t len);
+
+typedef struct telnet_lineedit {
+	uint8_t *line;             /* Current line (not NUL terminated) */
+	uint16_t size;             /* Max line length */
+	uint16_t len;              /* Length of current line */
+	uint16_t pos;              /* Cursor position (offset in line) */
+	uint8_t esc_state;
+	uint8_t esc_param;
+	uint8_t hist_index;        /* History entry being shown (0 = none) */
+	bool prev_cr : 1;          /* Last character was CR (ignore LF after it) */
+	bool free_buf : 1;
+	telnet_ringbuffer_t history; /* Previous lines, each terminated with NUL */
+} telnet_lineedit_t;
+
+
+int telnet_lineedit_init(telnet_lineedit_t *le, uint8_t *buf, size_t line_size, size_t history_size);
+void telnet_lineedit_free(telnet_lineedit_t *le);
+void telnet_lineedit_reset(telnet_lineedit_t *le);
+int telnet_lineedit_input(telnet_lineedit_t *le, uint8_t c, telnet_lineedit_out_t out, void *ctx);
+void telnet_lineedit_accept(telnet_lineedit_t *le);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICO_TELNETD_LINEEDIT_H */
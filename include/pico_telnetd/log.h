@@ -39,8 +39,13 @@ extern "C"
 #define LOG_INFO      6
 #define LOG_DEBUG     7
 
+#ifdef TELNETD_NO_LOG
+static inline void telnetd_log_level(int priority) { }
+static inline void telnetd_log_msg(int priority, const char *format, ...) { }
+#else
 void telnetd_log_level(int priority);
 void telnetd_log_msg(int priority, const char *format, ...);
+#endif
 
 
 #ifdef __cplusplus
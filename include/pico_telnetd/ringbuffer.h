@@ -24,6 +24,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdarg.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -46,10 +47,13 @@ int telnet_ringbuffer_free(telnet_ringbuffer_t *rb);
 int telnet_ringbuffer_flush(telnet_ringbuffer_t *rb);
 size_t telnet_ringbuffer_size(telnet_ringbuffer_t *rb);
 int telnet_ringbuffer_add_char(telnet_ringbuffer_t *rb, uint8_t ch, bool overwrite);
-int telnet_ringbuffer_add(telnet_ringbuffer_t *rb, uint8_t *data, size_t len, bool overwrite);
+int telnet_ringbuffer_add(telnet_ringbuffer_t *rb, const uint8_t *data, size_t len, bool overwrite);
+int telnet_ringbuffer_vprintf(telnet_ringbuffer_t *rb, const char *format, va_list ap);
+int telnet_ringbuffer_prepend(telnet_ringbuffer_t *rb, const uint8_t *data, size_t len);
 int telnet_ringbuffer_read_char(telnet_ringbuffer_t *rb);
 int telnet_ringbuffer_read(telnet_ringbuffer_t *rb, uint8_t *ptr, size_t size);
 size_t telnet_ringbuffer_peek(telnet_ringbuffer_t *rb, uint8_t **ptr, size_t size);
+size_t telnet_ringbuffer_peek_at(telnet_ringbuffer_t *rb, size_t offset, uint8_t **ptr, size_t size);
 int telnet_ringbuffer_peek_char(telnet_ringbuffer_t *rb, size_t offset);
 
 
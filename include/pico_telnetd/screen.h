@@ -0,0 +1,85 @@
+/* screen.h
+   Copyright (C) 2024 Timo Kokkonen <tjko@iki.fi>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+
+   This file is part of pico-telnetd Library.
+
+   pico-telnetd Library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   pico-telnetd Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with pico-telnetd Library. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PICO_TELNETD_SCREEN_H
+#define PICO_TELNETD_SCREEN_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Cell attributes */
+#define TELNET_SCREEN_BOLD      0x01
+#define TELNET_SCREEN_UNDERLINE 0x02
+#define TELNET_SCREEN_BLINK     0x04
+#define TELNET_SCREEN_REVERSE   0x08
+
+/* Cell colors: foreground in low nibble, background in high nibble.
+   0 = terminal default, 1..8 = ANSI colors 0..7 (black, red, green, yellow, blue, magenta, cyan, white) */
+#define TELNET_SCREEN_COLOR(fg, bg) ((uint8_t)(((bg) << 4) | (fg)))
+
+/* Number of cells needed for buffer passed to telnet_screen_init() */
+#define TELNET_SCREEN_BUF_CELLS(cols, rows) (2 * (cols) * (rows))
+
+typedef struct telnet_screen_cell {
+	uint8_t ch;
+	uint8_t attr;
+	uint8_t color;
+} telnet_screen_cell_t;
+
+/* Output function for telnet_screen_render(), returns false if there was no room for the data. */
+typedef bool (*telnet_screen_out_t)(void *ctx, const uint8_t *buf, size_t len);
+
+typedef struct telnet_screen {
+	telnet_screen_cell_t *cells; /* Screen drawn by application */
+	telnet_screen_cell_t *shown; /* Screen as currently shown by the terminal */
+	uint8_t cols;
+	uint8_t rows;
+	uint8_t cx;                /* Terminal cursor position (cx = 0xff if unknown) */
+	uint8_t cy;
+	uint8_t attr;              /* Terminal current attributes */
+	uint8_t color;
+	uint8_t draw_attr;         /* Attributes used by telnet_screen_print() */
+	uint8_t draw_color;
+	bool valid : 1;            /* Terminal has been cleared (shown is valid) */
+	bool free_buf : 1;
+} telnet_screen_t;
+
+
+int telnet_screen_init(telnet_screen_t *scr, uint8_t cols, uint8_t rows, telnet_screen_cell_t *buf);
+void telnet_screen_free(telnet_screen_t *scr);
+void telnet_screen_clear(telnet_screen_t *scr);
+void telnet_screen_set_attr(telnet_screen_t *scr, uint8_t attr, uint8_t color);
+int telnet_screen_print(telnet_screen_t *scr, uint8_t x, uint8_t y, const char *text);
+int telnet_screen_printf(telnet_screen_t *scr, uint8_t x, uint8_t y, const char *format, ...);
+void telnet_screen_invalidate(telnet_screen_t *scr);
+int telnet_screen_render(telnet_screen_t *scr, telnet_screen_out_t out, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICO_TELNETD_SCREEN_H */
@@ -0,0 +1,101 @@
+/* alloc.c
+   Copyright (C) 2024 Timo Kokkonen <tjko@iki.fi>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+
+   This file is part of pico-telnetd Library.
+
+   pico-telnetd Library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   pico-telnetd Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with pico-telnetd Library. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "pico_telnetd/alloc.h"
+
+#ifdef TELNETD_STATIC_ALLOC
+#pragma GCC poison malloc calloc realloc
+#endif
+
+static void* default_alloc(void *ctx, size_t size, size_t align, telnetd_alloc_tag_t tag)
+{
+	(void)ctx;
+	(void)tag;
+#ifdef TELNETD_STATIC_ALLOC
+	(void)size;
+	(void)align;
+	return NULL;
+#else
+	/* malloc() only guarantees alignment suitable for any standard type */
+	if (align > _Alignof(max_align_t))
+		return NULL;
+	return malloc(size);
+#endif
+}
+
+
+static void default_free(void *ctx, void *ptr, size_t size, telnetd_alloc_tag_t tag)
+{
+	(void)ctx;
+	(void)size;
+	(void)tag;
+#ifdef TELNETD_STATIC_ALLOC
+	(void)ptr;
+#else
+	free(ptr);
+#endif
+}
+
+
+static const telnetd_allocator_t default_allocator = {
+	.alloc = default_alloc,
+	.free = default_free,
+	.ctx = NULL
+};
+
+static const telnetd_allocator_t *allocator = &default_allocator;
+
+
+void telnetd_set_allocator(const telnetd_allocator_t *a)
+{
+	allocator = (a ? a : &default_allocator);
+}
+
+
+/* Allocate zero-filled memory block. */
+void* telnetd_alloc(size_t size, size_t align, telnetd_alloc_tag_t tag)
+{
+	void *ptr;
+
+	if (size < 1)
+		return NULL;
+	if (align < 1)
+		align = 1;
+
+	if ((ptr = allocator->alloc(allocator->ctx, size, align, tag)))
+		memset(ptr, 0, size);
+
+	return ptr;
+}
+
+
+void telnetd_free(void *ptr, size_t size, telnetd_alloc_tag_t tag)
+{
+	if (ptr)
+		allocator->free(allocator->ctx, ptr, size, tag);
+}
+
@@ -0,0 +1,108 @@
+/* coalesce.c
+   Copyright (C) 2024 Timo Kokkonen <tjko@iki.fi>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+
+   This file is part of pico-telnetd Library.
+
+   pico-telnetd Library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   pico-telnetd Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with pico-telnetd Library. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "pico_telnetd/coalesce.h"
+
+
+/* Length of the line rewrite at offset in rb, including the terminating CR.
+   Returns 0 if there is no complete rewrite (line ends with LF, or no CR followed by more data). */
+size_t telnet_coalesce_cr_frame(telnet_ringbuffer_t *rb, size_t offset)
+{
+	size_t used = telnet_ringbuffer_size(rb);
+
+	for (size_t o = offset; o + 1 < used; o++) {
+		int c = telnet_ringbuffer_peek_char(rb, o);
+
+		if (c == '\n')
+			return 0;
+		if (c == '\r')
+			return (telnet_ringbuffer_peek_char(rb, o + 1) == '\n' ? 0 : o + 1 - offset);
+	}
+
+	return 0;
+}
+
+
+/* Parameters of CUP/HVP sequence that move cursor to the top left corner */
+static const char *home_params[] = { "", "1", "1;1", ";1", "1;", ";" };
+
+/* Screen erase that must follow cursor home for it to start a redraw (optionally after attribute reset) */
+static const char *erase_seqs[] = { "\x1b[2J", "\x1b[J", "\x1b[0J",
+				    "\x1b[0m\x1b[2J", "\x1b[0m\x1b[J", "\x1b[m\x1b[2J", "\x1b[m\x1b[J" };
+
+
+static int match_at(telnet_ringbuffer_t *rb, size_t offset, const char *str)
+{
+	size_t used = telnet_ringbuffer_size(rb);
+
+	for (; *str; str++, offset++) {
+		if (offset >= used || telnet_ringbuffer_peek_char(rb, offset) != (uint8_t)*str)
+			return 0;
+	}
+
+	return 1;
+}
+
+
+/* Offset of redraw start, cursor home sequence (ESC [ H, ESC [ 1;1 H, etc.) followed by screen erase
+   (ESC [ 2 J, ESC [ J), at or after offset in rb, or -1 if none is found. Other cursor moves
+   (ESC [ 10;10 H, ...), and cursor home without erase (screen renderer updating top left cell),
+   do not count. */
+int telnet_coalesce_find_home(telnet_ringbuffer_t *rb, size_t offset)
+{
+	size_t used = telnet_ringbuffer_size(rb);
+
+	for (size_t o = offset; o + 2 < used; o++) {
+		char param[4];
+		size_t i, n = 0;
+		int c = -1;
+
+		if (telnet_ringbuffer_peek_char(rb, o) != 0x1b || telnet_ringbuffer_peek_char(rb, o + 1) != '[')
+			continue;
+		for (i = o + 2; i < used; i++) {
+			c = telnet_ringbuffer_peek_char(rb, i);
+			if ((c < '0' || c > '9') && c != ';')
+				break;
+			if (n < sizeof(param))
+				param[n] = c;
+			n++;
+		}
+		if (i == used || (c != 'H' && c != 'f') || n >= sizeof(param))
+			continue;
+		param[n] = 0;
+		for (n = 0; n < sizeof(home_params) / sizeof(home_params[0]); n++) {
+			if (!strcmp(param, home_params[n]))
+				break;
+		}
+		if (n == sizeof(home_params) / sizeof(home_params[0]))
+			continue;
+		for (n = 0; n < sizeof(erase_seqs) / sizeof(erase_seqs[0]); n++) {
+			if (match_at(rb, i + 1, erase_seqs[n]))
+				return o;
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,441 @@
+/* lineedit.c
+   Copyright (C) 2024 Timo Kokkonen <tjko@iki.fi>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+
+   This file is part of pico-telnetd Library.
+
+   pico-telnetd Library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   pico-telnetd Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with pico-telnetd Library. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pico_telnetd/lineedit.h"
+#include "pico_telnetd/alloc.h"
+
+#ifdef TELNETD_STATIC_ALLOC
+#pragma GCC poison malloc calloc realloc
+#endif
+
+enum { ESC_NONE = 0, ESC_ESC, ESC_CSI, ESC_SS3 };
+
+#define IS_CONT(c) (((c) & 0xc0) == 0x80)
+
+
+int telnet_lineedit_init(telnet_lineedit_t *le, uint8_t *buf, size_t line_size, size_t history_size)
+{
+	if (!le || line_size < 1 || line_size > UINT16_MAX)
+		return -1;
+
+	memset(le, 0, sizeof(telnet_lineedit_t));
+	if (!buf) {
+#ifdef TELNETD_STATIC_ALLOC
+		return -2;
+#else
+		if (!(buf = telnetd_alloc(line_size + history_size, 1, TELNETD_ALLOC_LINEEDIT)))
+			return -2;
+		le->free_buf = true;
+#endif
+	}
+
+	le->line = buf;
+	le->size = line_size;
+	telnet_ringbuffer_init(&le->history, buf + line_size, history_size);
+
+	return 0;
+}
+
+
+void telnet_lineedit_free(telnet_lineedit_t *le)
+{
+	if (!le)
+		return;
+
+	if (le->free_buf && le->line)
+		telnetd_free(le->line, le->size + le->history.size, TELNETD_ALLOC_LINEEDIT);
+	memset(le, 0, sizeof(telnet_lineedit_t));
+}
+
+
+void telnet_lineedit_reset(telnet_lineedit_t *le)
+{
+	le->len = 0;
+	le->pos = 0;
+	le->esc_state = ESC_NONE;
+	le->hist_index = 0;
+	le->prev_cr = false;
+	telnet_ringbuffer_flush(&le->history);
+}
+
+
+/* Number of characters (columns) in line[from..to) */
+static int line_cols(telnet_lineedit_t *le, size_t from, size_t to)
+{
+	int cols = 0;
+
+	for (size_t i = from; i < to; i++) {
+		if (!IS_CONT(le->line[i]))
+			cols++;
+	}
+
+	return cols;
+}
+
+
+static size_t prev_char(telnet_lineedit_t *le, size_t pos)
+{
+	while (pos > 0 && IS_CONT(le->line[--pos]))
+		;
+	return pos;
+}
+
+
+static size_t next_char(telnet_lineedit_t *le, size_t pos)
+{
+	do {
+		pos++;
+	} while (pos < le->len && IS_CONT(le->line[pos]));
+
+	return pos;
+}
+
+
+static void out_seq(telnet_lineedit_out_t out, void *ctx, const char *fmt, int n)
+{
+	char buf[16];
+	int len = snprintf(buf, sizeof(buf), fmt, n);
+
+	if (len > 0)
+		out(ctx, (uint8_t*)buf, len);
+}
+
+
+/* Move cursor by cols (negative is left) */
+static void out_move(telnet_lineedit_out_t out, void *ctx, int cols)
+{
+	if (cols == -1)
+		out(ctx, (uint8_t*)"\b", 1);
+	else if (cols < 0)
+		out_seq(out, ctx, "\x1b[%dD", -cols);
+	else if (cols == 1)
+		out(ctx, (uint8_t*)"\x1b[C", 3);
+	else if (cols > 0)
+		out_seq(out, ctx, "\x1b[%dC", cols);
+}
+
+
+/* Find history entry n (1 = newest). Returns offset of entry in history, or -1. */
+static int history_entry(telnet_lineedit_t *le, int n, size_t *len)
+{
+	telnet_ringbuffer_t *rb = &le->history;
+	int end = (int)telnet_ringbuffer_size(rb) - 1;
+
+	while (end > 0) {
+		int start = end;
+
+		while (start > 0 && telnet_ringbuffer_peek_char(rb, start - 1) != 0)
+			start--;
+		if (--n == 0) {
+			*len = end - start;
+			return start;
+		}
+		end = start - 1;
+	}
+
+	return -1;
+}
+
+
+static void history_add(telnet_lineedit_t *le)
+{
+	telnet_ringbuffer_t *rb = &le->history;
+	size_t len;
+	int o;
+
+	if (le->len == 0 || (size_t)le->len + 1 > rb->size)
+		return;
+
+	/* Skip if same as the previous line */
+	if ((o = history_entry(le, 1, &len)) >= 0 && len == le->len) {
+		size_t i;
+		for (i = 0; i < len; i++) {
+			if (telnet_ringbuffer_peek_char(rb, o + i) != le->line[i])
+				break;
+		}
+		if (i == len)
+			return;
+	}
+
+	/* Drop oldest entries to make room */
+	while (rb->free < (size_t)le->len + 1 && telnet_ringbuffer_size(rb) > 0) {
+		while (telnet_ringbuffer_read_char(rb) > 0)
+			;
+	}
+	telnet_ringbuffer_add(rb, le->line, le->len, false);
+	telnet_ringbuffer_add_char(rb, 0, false);
+}
+
+
+/* Replace current line with history entry n (0 = empty line), only the part of the line
+   that changes is redrawn. */
+static void history_recall(telnet_lineedit_t *le, int n, telnet_lineedit_out_t out, void *ctx)
+{
+	telnet_ringbuffer_t *rb = &le->history;
+	size_t nlen = 0;
+	size_t p = 0;
+	int o = 0;
+	uint8_t *ptr;
+
+	if (n > 0 && (o = history_entry(le, n, &nlen)) < 0)
+		return;
+	le->hist_index = n;
+
+	while (p < le->len && p < nlen && telnet_ringbuffer_peek_char(rb, o + p) == le->line[p])
+		p++;
+	while (p > 0 && ((p < le->len && IS_CONT(le->line[p]))
+				|| (p < nlen && IS_CONT(telnet_ringbuffer_peek_char(rb, o + p)))))
+		p--;
+
+	if (p < le->pos)
+		out_move(out, ctx, -line_cols(le, p, le->pos));
+	else
+		out_move(out, ctx, line_cols(le, le->pos, p));
+	if (p < le->len)
+		out(ctx, (uint8_t*)"\x1b[K", 3);
+
+	for (size_t i = p; i < nlen; i++)
+		le->line[i] = telnet_ringbuffer_peek_char(rb, o + i);
+	for (size_t i = p; i < nlen; ) {
+		size_t len = telnet_ringbuffer_peek_at(rb, o + i, &ptr, nlen - i);
+		out(ctx, ptr, len);
+		i += len;
+	}
+	le->len = le->pos = nlen;
+}
+
+
+static void insert_char(telnet_lineedit_t *le, uint8_t c, telnet_lineedit_out_t out, void *ctx)
+{
+	size_t need = 1;
+
+	/* Make sure whole UTF-8 character fits */
+	if (c >= 0xf0)
+		need = 4;
+	else if (c >= 0xe0)
+		need = 3;
+	else if (c >= 0xc0)
+		need = 2;
+	if (le->len + need > le->size) {
+		if (!IS_CONT(c))
+			out(ctx, (uint8_t*)"\a", 1);
+		return;
+	}
+
+	memmove(le->line + le->pos + 1, le->line + le->pos, le->len - le->pos);
+	le->line[le->pos] = c;
+	if (le->pos < le->len && !IS_CONT(c))
+		out(ctx, (uint8_t*)"\x1b[@", 3);
+	out(ctx, &c, 1);
+	le->len++;
+	le->pos++;
+}
+
+
+static void delete_chars(telnet_lineedit_t *le, size_t from, size_t to)
+{
+	memmove(le->line + from, le->line + to, le->len - to);
+	le->len -= to - from;
+}
+
+
+static void edit_key(telnet_lineedit_t *le, uint8_t key, telnet_lineedit_out_t out, void *ctx)
+{
+	size_t p;
+
+	switch (key) {
+	case 'A': /* Up */
+		history_recall(le, le->hist_index + 1, out, ctx);
+		break;
+	case 'B': /* Down */
+		if (le->hist_index > 0)
+			history_recall(le, le->hist_index - 1, out, ctx);
+		break;
+	case 'C': /* Right */
+		if (le->pos < le->len) {
+			le->pos = next_char(le, le->pos);
+			out_move(out, ctx, 1);
+		}
+		break;
+	case 'D': /* Left */
+		if (le->pos > 0) {
+			le->pos = prev_char(le, le->pos);
+			out_move(out, ctx, -1);
+		}
+		break;
+	case 'H': /* Home */
+		out_move(out, ctx, -line_cols(le, 0, le->pos));
+		le->pos = 0;
+		break;
+	case 'F': /* End */
+		out_move(out, ctx, line_cols(le, le->pos, le->len));
+		le->pos = le->len;
+		break;
+	case 'P': /* Delete */
+		if (le->pos < le->len) {
+			delete_chars(le, le->pos, next_char(le, le->pos));
+			out(ctx, (uint8_t*)"\x1b[P", 3);
+		}
+		break;
+	case 'h': /* Backspace */
+		if (le->pos > 0) {
+			p = prev_char(le, le->pos);
+			delete_chars(le, p, le->pos);
+			le->pos = p;
+			if (p == le->len)
+				out(ctx, (uint8_t*)"\b \b", 3);
+			else
+				out(ctx, (uint8_t*)"\b\x1b[P", 4);
+		}
+		break;
+	case 'U': /* Kill to start of line */
+		if (le->pos > 0) {
+			int cols = line_cols(le, 0, le->pos);
+			out_move(out, ctx, -cols);
+			out_seq(out, ctx, "\x1b[%dP", cols);
+			delete_chars(le, 0, le->pos);
+			le->pos = 0;
+		}
+		break;
+	case 'K': /* Kill to end of line */
+		if (le->pos < le->len) {
+			out(ctx, (uint8_t*)"\x1b[K", 3);
+			le->len = le->pos;
+		}
+		break;
+	}
+}
+
+
+/* Process one input character, terminal is updated by calling out(). */
+int telnet_lineedit_input(telnet_lineedit_t *le, uint8_t c, telnet_lineedit_out_t out, void *ctx)
+{
+	bool prev_cr = le->prev_cr;
+
+	le->prev_cr = false;
+
+	if (le->esc_state == ESC_ESC) {
+		le->esc_state = (c == '[' ? ESC_CSI : (c == 'O' ? ESC_SS3 : ESC_NONE));
+		return TELNET_LINEEDIT_NONE;
+	}
+	if (le->esc_state == ESC_CSI && c >= '0' && c <= '9') {
+		le->esc_param = (le->esc_param < 25 ? le->esc_param * 10 + (c - '0') : 255);
+		return TELNET_LINEEDIT_NONE;
+	}
+	if (le->esc_state == ESC_CSI || le->esc_state == ESC_SS3) {
+		if (c < 0x40 || c > 0x7e)
+			return TELNET_LINEEDIT_NONE;
+		le->esc_state = ESC_NONE;
+		if (c == '~') {
+			/* VT style keys: ESC [ n ~ */
+			switch (le->esc_param) {
+			case 1:
+			case 7:
+				c = 'H';
+				break;
+			case 3:
+				c = 'P';
+				break;
+			case 4:
+			case 8:
+				c = 'F';
+				break;
+			default:
+				return TELNET_LINEEDIT_NONE;
+			}
+		} else if (c == 'P' || c == 'h' || c == 'U' || c == 'K') {
+			return TELNET_LINEEDIT_NONE;
+		}
+		edit_key(le, c, out, ctx);
+		return TELNET_LINEEDIT_NONE;
+	}
+
+	switch (c) {
+	case 0x1b:
+		le->esc_state = ESC_ESC;
+		le->esc_param = 0;
+		return TELNET_LINEEDIT_NONE;
+	case '\n':
+		if (prev_cr)
+			return TELNET_LINEEDIT_NONE;
+		/* fall through */
+	case '\r':
+		le->prev_cr = (c == '\r');
+		out(ctx, (uint8_t*)"\r\n", 2);
+		return TELNET_LINEEDIT_LINE;
+	case 0x7f:
+	case 0x08:
+		c = 'h';
+		break;
+	case 0x01: /* Ctrl-A */
+		c = 'H';
+		break;
+	case 0x02: /* Ctrl-B */
+		c = 'D';
+		break;
+	case 0x04: /* Ctrl-D */
+		if (le->len == 0)
+			return TELNET_LINEEDIT_PASS;
+		c = 'P';
+		break;
+	case 0x05: /* Ctrl-E */
+		c = 'F';
+		break;
+	case 0x06: /* Ctrl-F */
+		c = 'C';
+		break;
+	case 0x0b: /* Ctrl-K */
+		c = 'K';
+		break;
+	case 0x0e: /* Ctrl-N */
+		c = 'B';
+		break;
+	case 0x10: /* Ctrl-P */
+		c = 'A';
+		break;
+	case 0x15: /* Ctrl-U */
+		c = 'U';
+		break;
+	default:
+		if (c < 0x20)
+			return TELNET_LINEEDIT_PASS;
+		insert_char(le, c, out, ctx);
+		return TELNET_LINEEDIT_NONE;
+	}
+
+	edit_key(le, c, out, ctx);
+	return TELNET_LINEEDIT_NONE;
+}
+
+
+/* Called after application has taken the completed line: save it in history and start a new line. */
+void telnet_lineedit_accept(telnet_lineedit_t *le)
+{
+	history_add(le);
+	le->len = 0;
+	le->pos = 0;
+	le->hist_index = 0;
+}
@@ -32,9 +32,14 @@
 #include "pico/util/datetime.h"
 
 #include "pico_telnetd/log.h"
+#include "pico_telnetd/alloc.h"
 
 #define LOG_MAX_MSG_LEN 256
 
+#ifdef TELNETD_STATIC_ALLOC
+#pragma GCC poison malloc calloc realloc
+#endif
+
 
 static int global_log_level = LOG_ERR;
 
@@ -80,7 +85,11 @@ void telnetd_log_level(int priority)
 void telnetd_log_msg(int priority, const char *format, ...)
 {
 	va_list ap;
+#ifdef TELNETD_STATIC_ALLOC
+	char buf[LOG_MAX_MSG_LEN];
+#else
 	char *buf;
+#endif
 	char tstamp[32];
 	int len;
 	uint core = get_core_num();
@@ -88,8 +97,10 @@ void telnetd_log_msg(int priority, const char *format, ...)
 	if (priority > global_log_level)
 		return;
 
-	if (!(buf = malloc(LOG_MAX_MSG_LEN)))
+#ifndef TELNETD_STATIC_ALLOC
+	if (!(buf = telnetd_alloc(LOG_MAX_MSG_LEN, 1, TELNETD_ALLOC_LOG)))
 		return;
+#endif
 
 	va_start(ap, format);
 	vsnprintf(buf, LOG_MAX_MSG_LEN, format, ap);
@@ -107,7 +118,9 @@ void telnetd_log_msg(int priority, const char *format, ...)
 		(t / 1000000), (t % 1000000), core);
 	printf("%s %s %s\n", tstamp, log_priority2str(priority), buf);
 
-	free(buf);
+#ifndef TELNETD_STATIC_ALLOC
+	telnetd_free(buf, LOG_MAX_MSG_LEN, TELNETD_ALLOC_LOG);
+#endif
 }
 
 
@@ -20,16 +20,21 @@
 */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 #include "pico_telnetd/ringbuffer.h"
+#include "pico_telnetd/alloc.h"
 
 #define PREFIX_LEN 1
 #define SUFFIX_LEN 1
 
+#ifdef TELNETD_STATIC_ALLOC
+#pragma GCC poison malloc calloc realloc
+#endif
 
 
 int telnet_ringbuffer_init(telnet_ringbuffer_t *rb, uint8_t *buf, size_t size)
@@ -38,9 +43,16 @@ int telnet_ringbuffer_init(telnet_ringbuffer_t *rb, uint8_t *buf, size_t size)
 		return -1;
 
 	if (!buf) {
-		if (!(rb->buf = calloc(1, size)))
+#ifdef TELNETD_STATIC_ALLOC
+		if (size > 0)
+			return -2;
+		rb->buf = NULL;
+		rb->free_buf = false;
+#else
+		if (!(rb->buf = telnetd_alloc(size, 1, TELNETD_ALLOC_RINGBUFFER)))
 			return -2;
 		rb->free_buf = true;
+#endif
 	} else {
 		rb->buf = buf;
 		rb->free_buf = false;
@@ -61,7 +73,7 @@ int telnet_ringbuffer_free(telnet_ringbuffer_t *rb)
 		return -1;
 
 	if (rb->free_buf && rb->buf)
-		free(rb->buf);
+		telnetd_free(rb->buf, rb->size, TELNETD_ALLOC_RINGBUFFER);
 
 	rb->buf = NULL;
 	rb->size = 0;
@@ -133,7 +145,7 @@ inline int telnet_ringbuffer_add_char(telnet_ringbuffer_t *rb, uint8_t ch, bool
 	return 0;
 }
 
-int telnet_ringbuffer_add(telnet_ringbuffer_t *rb, uint8_t *data, size_t len, bool overwrite)
+int telnet_ringbuffer_add(telnet_ringbuffer_t *rb, const uint8_t *data, size_t len, bool overwrite)
 {
 	if (!rb || !data)
 		return -1;
@@ -169,11 +181,87 @@ int telnet_ringbuffer_add(telnet_ringbuffer_t *rb, uint8_t *data, size_t len, bo
 	return 0;
 }
 
+/* Format string directly into the free space of the buffer. String is added only if it fits
+   completely (including space for the terminating NUL, which is not added). Returns number of bytes added. */
+int telnet_ringbuffer_vprintf(telnet_ringbuffer_t *rb, const char *format, va_list ap)
+{
+	va_list ap2;
+	size_t space;
+	int len;
+
+	if (!rb || !format)
+		return -1;
+
+	if (rb->free < 2)
+		return -2;
+
+	/* Contiguous free space after tail */
+	space = (rb->tail >= rb->head ? rb->size - rb->tail : rb->head - rb->tail);
+	if (space > rb->free)
+		space = rb->free;
+
+	va_copy(ap2, ap);
+	len = vsnprintf((char*)rb->buf + rb->tail, space, format, ap2);
+	va_end(ap2);
+	if (len < 0)
+		return -1;
+
+	if ((size_t)len >= space) {
+		if ((size_t)len >= rb->free)
+			return -2;
+		/* Free space wraps around: move data to the beginning of the buffer
+		   (so that free space is contiguous) and format again. */
+		size_t used = rb->size - rb->free;
+		memmove(rb->buf, rb->buf + rb->head, used);
+		rb->head = 0;
+		rb->tail = used;
+		va_copy(ap2, ap);
+		len = vsnprintf((char*)rb->buf + rb->tail, rb->free, format, ap2);
+		va_end(ap2);
+		if (len < 0 || (size_t)len >= rb->free)
+			return -2;
+	}
+
+	rb->tail = telnet_ringbuffer_offset(rb, rb->tail, len, 1);
+	rb->free -= len;
+
+	return len;
+}
+
+
+/* Insert data in front of the oldest byte (data will be read next). */
+int telnet_ringbuffer_prepend(telnet_ringbuffer_t *rb, const uint8_t *data, size_t len)
+{
+	if (!rb || !data)
+		return -1;
+
+	if (len == 0)
+		return 0;
+
+	if (rb->free < len)
+		return -3;
+
+	size_t new_head = telnet_ringbuffer_offset(rb, rb->head, len, -1);
+
+	if (new_head < rb->head) {
+		memcpy(rb->buf + new_head, data, len);
+	} else {
+		size_t part1 = rb->size - new_head;
+		memcpy(rb->buf + new_head, data, part1);
+		memcpy(rb->buf, data + part1, len - part1);
+	}
+
+	rb->head = new_head;
+	rb->free -= len;
+
+	return 0;
+}
+
 inline int telnet_ringbuffer_read_char(telnet_ringbuffer_t *rb)
 {
 	if (!rb)
 		return -1;
-	if (rb->head == rb->tail)
+	if (rb->free == rb->size)
 		return -2;
 
 	int val = rb->buf[rb->head];
@@ -187,7 +275,7 @@ inline int telnet_ringbuffer_peek_char(telnet_ringbuffer_t *rb, size_t offset)
 {
 	if (!rb)
 		return -1;
-	if (rb->head == rb->tail)
+	if (rb->free == rb->size)
 		return -2;
 	if (offset >= (rb->size - rb->free))
 		return -3;
@@ -242,3 +330,23 @@ size_t telnet_ringbuffer_peek(telnet_ringbuffer_t *rb, uint8_t **ptr, size_t siz
 }
 
 
+/* Like telnet_ringbuffer_peek(), but return span starting at offset (from the oldest byte)
+   without consuming anything. */
+size_t telnet_ringbuffer_peek_at(telnet_ringbuffer_t *rb, size_t offset, uint8_t **ptr, size_t size)
+{
+	if (!rb || !ptr || size < 1)
+		return 0;
+
+	*ptr = NULL;
+	size_t used = rb->size - rb->free;
+	if (offset >= used)
+		return 0;
+
+	size_t start = telnet_ringbuffer_offset(rb, rb->head, offset, 1);
+	size_t toread = (size < used - offset ? size : used - offset);
+	size_t len = rb->size - start;
+
+	*ptr = rb->buf + start;
+
+	return (len < toread ? len : toread);
+}
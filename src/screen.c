@@ -0,0 +1,345 @@
+/* screen.c
+   Copyright (C) 2024 Timo Kokkonen <tjko@iki.fi>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+
+   This file is part of pico-telnetd Library.
+
+   pico-telnetd Library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   pico-telnetd Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with pico-telnetd Library. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pico_telnetd/screen.h"
+#include "pico_telnetd/alloc.h"
+
+#ifdef TELNETD_STATIC_ALLOC
+#pragma GCC poison malloc calloc realloc
+#endif
+
+#define CURSOR_UNKNOWN 0xff
+
+/* Escape sequence being built */
+typedef struct seq {
+	size_t len;
+	char buf[48];
+} seq_t;
+
+
+static void seq_add(seq_t *s, const char *str, size_t len)
+{
+	if (s->len + len > sizeof(s->buf))
+		len = sizeof(s->buf) - s->len;
+	memcpy(s->buf + s->len, str, len);
+	s->len += len;
+}
+
+
+static void seq_printf(seq_t *s, const char *format, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, format);
+	len = vsnprintf(s->buf + s->len, sizeof(s->buf) - s->len, format, ap);
+	va_end(ap);
+	if (len > 0)
+		s->len = (s->len + len < sizeof(s->buf) ? s->len + len : sizeof(s->buf) - 1);
+}
+
+
+static inline uint8_t cell_char(const telnet_screen_cell_t *c)
+{
+	return (c->ch >= 0x20 && c->ch < 0x7f ? c->ch : ' ');
+}
+
+
+int telnet_screen_init(telnet_screen_t *scr, uint8_t cols, uint8_t rows, telnet_screen_cell_t *buf)
+{
+	size_t cells = TELNET_SCREEN_BUF_CELLS(cols, rows);
+
+	if (!scr || cols < 1 || rows < 1 || cols == CURSOR_UNKNOWN)
+		return -1;
+
+	memset(scr, 0, sizeof(telnet_screen_t));
+	if (!buf) {
+#ifdef TELNETD_STATIC_ALLOC
+		return -2;
+#else
+		if (!(buf = telnetd_alloc(cells * sizeof(telnet_screen_cell_t),
+						_Alignof(telnet_screen_cell_t), TELNETD_ALLOC_SCREEN)))
+			return -2;
+		scr->free_buf = true;
+#endif
+	}
+
+	scr->cols = cols;
+	scr->rows = rows;
+	scr->cells = buf;
+	scr->shown = buf + cells / 2;
+	telnet_screen_clear(scr);
+	telnet_screen_invalidate(scr);
+
+	return 0;
+}
+
+
+void telnet_screen_free(telnet_screen_t *scr)
+{
+	if (!scr)
+		return;
+
+	if (scr->free_buf && scr->cells)
+		telnetd_free(scr->cells, TELNET_SCREEN_BUF_CELLS(scr->cols, scr->rows) * sizeof(telnet_screen_cell_t),
+			TELNETD_ALLOC_SCREEN);
+	memset(scr, 0, sizeof(telnet_screen_t));
+}
+
+
+void telnet_screen_clear(telnet_screen_t *scr)
+{
+	for (size_t i = 0; i < scr->cols * scr->rows; i++) {
+		scr->cells[i].ch = ' ';
+		scr->cells[i].attr = 0;
+		scr->cells[i].color = 0;
+	}
+}
+
+
+void telnet_screen_set_attr(telnet_screen_t *scr, uint8_t attr, uint8_t color)
+{
+	scr->draw_attr = attr;
+	scr->draw_color = color;
+}
+
+
+/* Draw text at (x, y), text is clipped at end of the row. Returns number of cells drawn. */
+int telnet_screen_print(telnet_screen_t *scr, uint8_t x, uint8_t y, const char *text)
+{
+	telnet_screen_cell_t *c;
+	int count = 0;
+
+	if (!scr || !text || x >= scr->cols || y >= scr->rows)
+		return -1;
+
+	c = &scr->cells[y * scr->cols + x];
+	while (*text && x + count < scr->cols) {
+		c->ch = *text++;
+		c->attr = scr->draw_attr;
+		c->color = scr->draw_color;
+		c++;
+		count++;
+	}
+
+	return count;
+}
+
+
+int telnet_screen_printf(telnet_screen_t *scr, uint8_t x, uint8_t y, const char *format, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+
+	return telnet_screen_print(scr, x, y, buf);
+}
+
+
+/* Terminal state is unknown (new connection, etc.), next render clears and redraws the screen. */
+void telnet_screen_invalidate(telnet_screen_t *scr)
+{
+	scr->valid = false;
+	scr->cx = CURSOR_UNKNOWN;
+}
+
+
+/* Horizontal cursor movement (on row y) from column a to b */
+static void move_horizontal(telnet_screen_t *scr, seq_t *s, uint8_t y, uint8_t a, uint8_t b)
+{
+	const telnet_screen_cell_t *row = &scr->shown[y * scr->cols];
+
+	if (b > a) {
+		uint8_t n = b - a;
+		uint8_t i;
+
+		/* Rewriting few unchanged characters is shorter than cursor movement */
+		for (i = a; n <= 3 && i < b; i++) {
+			if (row[i].attr != scr->attr || row[i].color != scr->color)
+				break;
+		}
+		if (n <= 3 && i == b) {
+			for (i = a; i < b; i++) {
+				char ch = cell_char(&row[i]);
+				seq_add(s, &ch, 1);
+			}
+		} else if (n == 1) {
+			seq_add(s, "\x1b[C", 3);
+		} else {
+			seq_printf(s, "\x1b[%uC", n);
+		}
+	} else if (b < a) {
+		/* Bare CR is not used, so that output is not mistaken for status line
+		   rewrites (coalesce_mode) */
+		uint8_t n = a - b;
+
+		if (n <= 3)
+			seq_add(s, "\b\b\b", n);
+		else
+			seq_printf(s, "\x1b[%uD", n);
+	}
+}
+
+
+/* Shortest cursor movement to (x, y) */
+static void move_cursor(telnet_screen_t *scr, seq_t *s, uint8_t x, uint8_t y)
+{
+	seq_t best = { .len = 0 };
+	seq_t rel = { .len = 0 };
+
+	if (scr->cy == y && scr->cx == x)
+		return;
+
+	if (x > 0)
+		seq_printf(&best, "\x1b[%u;%uH", y + 1, x + 1);
+	else
+		seq_printf(&best, "\x1b[%uH", y + 1);
+
+	if (scr->cx != CURSOR_UNKNOWN) {
+		if (y == scr->cy) {
+			move_horizontal(scr, &rel, y, scr->cx, x);
+		} else {
+			if (y > scr->cy)
+				seq_printf(&rel, (y - scr->cy == 1 ? "\x1b[B" : "\x1b[%uB"), y - scr->cy);
+			else
+				seq_printf(&rel, (scr->cy - y == 1 ? "\x1b[A" : "\x1b[%uA"), scr->cy - y);
+			move_horizontal(scr, &rel, y, scr->cx, x);
+		}
+		if (rel.len < best.len)
+			best = rel;
+
+		if (y == scr->cy + 1) {
+			/* Start of next line */
+			rel.len = 0;
+			seq_add(&rel, "\r\n", 2);
+			move_horizontal(scr, &rel, y, 0, x);
+			if (rel.len < best.len)
+				best = rel;
+		}
+	}
+
+	seq_add(s, best.buf, best.len);
+}
+
+
+/* Change attributes (SGR) */
+static void set_attr(telnet_screen_t *scr, seq_t *s, uint8_t attr, uint8_t color)
+{
+	static const uint8_t sgr[] = { 1, 4, 5, 7 };
+	uint8_t cur = scr->attr;
+	uint8_t cur_color = scr->color;
+	char sep = '[';
+
+	if (attr == cur && color == cur_color)
+		return;
+
+	seq_add(s, "\x1b", 1);
+	if (cur & ~attr) {
+		/* Attribute removed, need to reset all */
+		seq_add(s, "[0", 2);
+		sep = ';';
+		cur = 0;
+		cur_color = 0;
+	}
+	for (int i = 0; i < 4; i++) {
+		if ((attr & ~cur) & (1 << i)) {
+			seq_printf(s, "%c%u", sep, sgr[i]);
+			sep = ';';
+		}
+	}
+	if ((color & 0x0f) != (cur_color & 0x0f)) {
+		seq_printf(s, "%c%u", sep, (color & 0x0f) ? 30 + (color & 0x0f) - 1 : 39);
+		sep = ';';
+	}
+	if ((color & 0xf0) != (cur_color & 0xf0)) {
+		seq_printf(s, "%c%u", sep, (color & 0xf0) ? 40 + (color >> 4) - 1 : 49);
+		sep = ';';
+	}
+	seq_add(s, "m", 1);
+}
+
+
+/* Send changed cells to terminal, with as little cursor movement and attribute changes as possible.
+   Stops when out() has no more room. Returns number of cells not yet sent (0 = terminal is up to date). */
+int telnet_screen_render(telnet_screen_t *scr, telnet_screen_out_t out, void *ctx)
+{
+	size_t count = scr->cols * scr->rows;
+	int pending = 0;
+
+	if (!scr->valid) {
+		/* Starts with cursor home + erase, so coalesce_mode can skip older queued output */
+		const char *clear = "\x1b[H\x1b[0m\x1b[2J";
+
+		if (!out(ctx, (const uint8_t*)clear, strlen(clear)))
+			return count;
+		for (size_t i = 0; i < count; i++) {
+			scr->shown[i].ch = ' ';
+			scr->shown[i].attr = 0;
+			scr->shown[i].color = 0;
+		}
+		scr->cx = scr->cy = 0;
+		scr->attr = scr->color = 0;
+		scr->valid = true;
+	}
+
+	for (uint8_t y = 0; y < scr->rows; y++) {
+		for (uint8_t x = 0; x < scr->cols; x++) {
+			telnet_screen_cell_t *c = &scr->cells[y * scr->cols + x];
+			telnet_screen_cell_t *s = &scr->shown[y * scr->cols + x];
+			seq_t seq = { .len = 0 };
+			char ch;
+
+			if (cell_char(c) == cell_char(s) && c->attr == s->attr && c->color == s->color)
+				continue;
+			if (pending > 0) {
+				pending++;
+				continue;
+			}
+
+			move_cursor(scr, &seq, x, y);
+			set_attr(scr, &seq, c->attr, c->color);
+			ch = cell_char(c);
+			seq_add(&seq, &ch, 1);
+			if (!out(ctx, (const uint8_t*)seq.buf, seq.len)) {
+				pending++;
+				continue;
+			}
+
+			*s = *c;
+			scr->attr = c->attr;
+			scr->color = c->color;
+			scr->cy = y;
+			/* Cursor position after writing last column depends on terminal */
+			scr->cx = (x + 1 < scr->cols ? x + 1 : CURSOR_UNKNOWN);
+		}
+	}
+
+	return pending;
+}
@@ -20,18 +20,26 @@
 */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
+#include <inttypes.h>
 #include <time.h>
 #include <assert.h>
 #include "pico/stdlib.h"
+#ifndef TELNETD_NO_STDIO
 #include "pico/stdio/driver.h"
+#endif
 
 #include "pico/cyw43_arch.h"
+#include "pico/async_context.h"
+#include "pico/rand.h"
 #include "lwip/pbuf.h"
 #include "lwip/tcp.h"
 
 #include "pico_telnetd.h"
 #include "pico_telnetd/log.h"
+#include "pico_telnetd/alloc.h"
+#include "pico_telnetd/coalesce.h"
 
 
 /* Telnet commands */
@@ -71,50 +79,255 @@
 
 
 #define TELNET_DEFAULT_PORT 23
-#define TCP_SERVER_MAX_CONN 1
 #define TCP_CLIENT_POLL_TIME 1
+#define TELNET_LOGIN_DELAY_MS 1000
+#define TCP_RX_RETRY_MS 100
+#define TCP_DEFAULT_FLUSH_DELAY 2
+
+#ifdef TELNETD_STATIC_ALLOC
+#define TCP_DEFAULT_RXBUF_SIZE TELNETD_STATIC_RXBUF_SIZE
+#define TCP_DEFAULT_TXBUF_SIZE TELNETD_STATIC_TXBUF_SIZE
+#else
+#define TCP_DEFAULT_RXBUF_SIZE 2048
+#define TCP_DEFAULT_TXBUF_SIZE 2048
+#endif
+
+/* How long to wait (ms) for client to respond to telnet negotiation before sending banner anyway. */
+#ifndef TELNET_NEGOTIATION_TIMEOUT_MS
+#define TELNET_NEGOTIATION_TIMEOUT_MS 150
+#endif
+
+/* Session is considered stale (TAKEOVER_STALE) when the same segment has been retransmitted this
+   many times (RTO backs off exponentially, so this is several seconds without any ACK). */
+#ifndef TELNET_STALE_RETRANSMITS
+#define TELNET_STALE_RETRANSMITS 4
+#endif
+
+/* Output generated within this time (ms) after client input is considered interactive... */
+#ifndef TELNET_INTERACTIVE_WINDOW_MS
+#define TELNET_INTERACTIVE_WINDOW_MS 250
+#endif
+/* ...as long as the amount of pending output (bytes) is small. */
+#ifndef TELNET_INTERACTIVE_MAX_LEN
+#define TELNET_INTERACTIVE_MAX_LEN 128
+#endif
+
+/* Overflow marker, and max length of it */
+#define TELNET_DROP_MARKER     "\r\n[%lu bytes dropped]\r\n"
+#define TELNET_DROP_MARKER_MAX 32
+
+/* How far past the needed space to look for end of line when evicting output,
+   longer lines are cut at next clean (escape sequence/UTF-8) boundary. */
+#define TELNET_OVERFLOW_SCAN   256
+
+/* Number of sessions that can be at login prompt at the same time (0 = all sessions). */
+#ifndef TELNET_MAX_CONCURRENT_LOGINS
+#define TELNET_MAX_CONCURRENT_LOGINS 0
+#endif
+
+/* Time (seconds) client has for logging in after connecting (login_timeout). */
+#ifndef TELNET_DEFAULT_LOGIN_TIMEOUT
+#define TELNET_DEFAULT_LOGIN_TIMEOUT 60
+#endif
+
+/* Max size (bytes) of per-session state (excluding buffers) on 32-bit targets. */
+#ifndef TELNET_SESSION_RAM_BUDGET
+#define TELNET_SESSION_RAM_BUDGET 144
+#endif
+
+#if UINTPTR_MAX == 0xffffffff
+_Static_assert(sizeof(telnet_session_t) <= TELNET_SESSION_RAM_BUDGET,
+	"telnet_session_t exceeds TELNET_SESSION_RAM_BUDGET");
+#endif
 
+#ifndef TELNETD_NO_STDIO
 tcp_server_t *stdio_tcpserv = NULL;
 
 static void (*chars_available_callback)(void*) = NULL;
 static void *chars_available_param = NULL;
+static uint8_t stdio_next_session = 0;
+#endif
 
+#ifdef TELNETD_NO_LOG
+/* Arguments are type checked (and count as used), but never evaluated */
+#define LOG_MSG(...) { (void)st; if (0) telnetd_log_msg(__VA_ARGS__); }
+#endif
 #ifndef LOG_MSG
 #define LOG_MSG(...) { if (st->log_cb) st->log_cb(__VA_ARGS__); }
 #endif
 
+#define for_each_session(st, ss) \
+	for (telnet_session_t *ss = (st)->sessions; ss < (st)->sessions + (st)->max_sessions; ss++)
+
 static const char *telnet_default_banner = "\r\npico-telnetd\r\n\r\n";
+/* Login name prefix for resuming detached session */
+#ifndef TELNET_RESUME_PREFIX
+#define TELNET_RESUME_PREFIX "resume:"
+#endif
+
+#ifndef TELNETD_NO_AUTH
 static const char* telnet_login_prompt = "\r\nlogin: ";
 static const char* telnet_passwd_prompt = "\r\npassword: ";
 static const char* telnet_login_failed = "\r\nLogin failed.\r\n";
 static const char* telnet_login_success = "\r\nLogin successful.\r\n";
+static const char* telnet_no_sessions = "\r\nNo free sessions.\r\n";
+#endif
 
+#ifndef TELNETD_NO_TELNET_MODE
 static const uint8_t telnet_default_options[] = {
 	IAC, TELNET_DO, TO_SUP_GA,
 	IAC, TELNET_WILL, TO_ECHO,
 	IAC, TELNET_WONT, TO_LINEMODE,
 };
+#endif
+
+
+static void tcp_server_flush_worker(async_context_t *context, async_at_time_worker_t *worker);
+static void tcp_server_input_worker(async_context_t *context, async_when_pending_worker_t *worker);
+static void tcp_server_timer_worker(async_context_t *context, async_at_time_worker_t *worker);
+
+#ifdef TELNETD_STATIC_ALLOC
+
+/* One login buffer per session (and takeover slot), unless limited */
+#define TELNETD_STATIC_LOGINS (TELNET_MAX_CONCURRENT_LOGINS > 0 && TELNET_MAX_CONCURRENT_LOGINS <= TELNETD_STATIC_SESSIONS ? \
+				TELNET_MAX_CONCURRENT_LOGINS : TELNETD_STATIC_SESSIONS + 1)
+
+static tcp_server_t static_server;
+static bool static_server_used = false;
+static telnet_session_t static_sessions[TELNETD_STATIC_SESSIONS];
+static uint8_t static_rxbuf[TELNETD_STATIC_SESSIONS][TELNETD_STATIC_RXBUF_SIZE];
+static uint8_t static_txbuf[TELNETD_STATIC_SESSIONS][TELNETD_STATIC_TXBUF_SIZE];
+#if !defined(TELNETD_NO_STDIO) && TELNETD_STATIC_HISTORY_SIZE > 0
+static uint8_t static_history[TELNETD_STATIC_HISTORY_SIZE];
+#endif
+#if !defined(TELNETD_NO_LINEEDIT) && TELNETD_STATIC_LINE_SIZE > 0
+static telnet_lineedit_t static_editors[TELNETD_STATIC_SESSIONS];
+static uint8_t static_editbuf[TELNETD_STATIC_SESSIONS][TELNETD_STATIC_LINE_SIZE + TELNETD_STATIC_LINE_HISTORY];
+#endif
+#ifndef TELNETD_NO_AUTH
+static telnet_auth_t static_auth_pool[TELNETD_STATIC_LOGINS];
+static telnet_session_t static_pending;
+static uint8_t static_pending_rxbuf[MAX_PASSWORD_LENGTH + 2];
+#endif
+
+#pragma GCC poison malloc calloc realloc
+
+#endif
+
+
+static void tcp_server_free_sessions(tcp_server_t *st)
+{
+	if (!st->sessions)
+		return;
+
+	for_each_session(st, ss) {
+		telnet_ringbuffer_free(&ss->rb_in);
+		telnet_ringbuffer_free(&ss->rb_out);
+	}
+#ifndef TELNETD_STATIC_ALLOC
+	telnetd_free(st->sessions, st->max_sessions * sizeof(telnet_session_t), TELNETD_ALLOC_SESSIONS);
+#endif
+	st->sessions = NULL;
+}
+
+
+#ifndef TELNETD_NO_LINEEDIT
+static void tcp_server_free_editors(tcp_server_t *st)
+{
+	if (!st->editors)
+		return;
+
+	for_each_session(st, ss)
+		telnet_lineedit_free(&st->editors[ss - st->sessions]);
+#ifndef TELNETD_STATIC_ALLOC
+	telnetd_free(st->editors, st->max_sessions * sizeof(telnet_lineedit_t), TELNETD_ALLOC_LINEEDIT);
+#endif
+	st->editors = NULL;
+}
+#endif
+
+
+static void tcp_server_init_session(tcp_server_t *st, telnet_session_t *ss)
+{
+	ss->server = st;
+	ss->cstate = CS_NONE;
+	ss->flush_worker.do_work = tcp_server_flush_worker;
+	ss->flush_worker.user_data = ss;
+	ss->timer_worker.do_work = tcp_server_timer_worker;
+	ss->timer_worker.user_data = ss;
+}
 
 
-static tcp_server_t* tcp_server_init(size_t rxbuf_size, size_t txbuf_size)
+static tcp_server_t* tcp_server_init(size_t rxbuf_size, size_t txbuf_size, uint8_t max_sessions)
 {
-	tcp_server_t *st = calloc(1, sizeof(tcp_server_t));
+#ifdef TELNETD_STATIC_ALLOC
+	tcp_server_t *st = &static_server;
+
+	if (static_server_used || max_sessions > TELNETD_STATIC_SESSIONS
+		|| rxbuf_size > TELNETD_STATIC_RXBUF_SIZE || txbuf_size > TELNETD_STATIC_TXBUF_SIZE) {
+		telnetd_log_msg(LOG_WARNING, "Static tcp server state not available");
+		return NULL;
+	}
+	memset(st, 0, sizeof(tcp_server_t));
+	memset(static_sessions, 0, sizeof(static_sessions));
+	static_server_used = true;
+#else
+	tcp_server_t *st = telnetd_alloc(sizeof(tcp_server_t), _Alignof(tcp_server_t), TELNETD_ALLOC_SERVER);
 
 	if (!st) {
-		LOG_MSG(LOG_WARNING, "Failed to allocate tcp server state");
+		telnetd_log_msg(LOG_WARNING, "Failed to allocate tcp server state");
 		return NULL;
 	}
+#endif
 
-	telnet_ringbuffer_init(&st->rb_in, NULL, rxbuf_size);
-	telnet_ringbuffer_init(&st->rb_out, NULL, txbuf_size);
 	st->mode = RAW_MODE;
-	st->cstate = CS_NONE;
+#ifndef TELNETD_NO_LOG
 	st->log_cb = telnetd_log_msg;
+#endif
+#ifndef TELNETD_NO_AUTH
 	st->auth_cb = NULL;
+	st->login_timeout = TELNET_DEFAULT_LOGIN_TIMEOUT;
+#endif
 	st->port = TELNET_DEFAULT_PORT;
 	st->banner = telnet_default_banner;
 	st->auto_flush = true;
+	st->nagle_mode = NAGLE_AUTO;
+	st->flush_delay = TCP_DEFAULT_FLUSH_DELAY;
 	st->allow_connect_cb = NULL;
+	st->on_connect = NULL;
+	st->on_data = NULL;
+	st->on_disconnect = NULL;
+	st->input_worker.do_work = tcp_server_input_worker;
+	st->input_worker.user_data = st;
+
+	/* Preallocate session pool... */
+#ifdef TELNETD_STATIC_ALLOC
+	st->sessions = static_sessions;
+#else
+	if (!(st->sessions = telnetd_alloc(max_sessions * sizeof(telnet_session_t),
+						_Alignof(telnet_session_t), TELNETD_ALLOC_SESSIONS))) {
+		LOG_MSG(LOG_WARNING, "Failed to allocate session pool");
+		telnetd_free(st, sizeof(tcp_server_t), TELNETD_ALLOC_SERVER);
+		return NULL;
+	}
+#endif
+	st->max_sessions = max_sessions;
+
+	for_each_session(st, ss) {
+		tcp_server_init_session(st, ss);
+#ifdef TELNETD_STATIC_ALLOC
+		telnet_ringbuffer_init(&ss->rb_in, static_rxbuf[ss - st->sessions], rxbuf_size);
+		telnet_ringbuffer_init(&ss->rb_out, static_txbuf[ss - st->sessions], txbuf_size);
+#else
+		if (telnet_ringbuffer_init(&ss->rb_in, NULL, rxbuf_size)
+			|| telnet_ringbuffer_init(&ss->rb_out, NULL, txbuf_size)) {
+			LOG_MSG(LOG_WARNING, "Failed to allocate session buffers");
+			tcp_server_free_sessions(st);
+			telnetd_free(st, sizeof(tcp_server_t), TELNETD_ALLOC_SERVER);
+			return NULL;
+		}
+#endif
+	}
 
 	return st;
 }
@@ -139,6 +352,187 @@ static err_t close_client_connection(struct tcp_pcb *pcb)
 }
 
 
+static err_t abort_client_connection(struct tcp_pcb *pcb)
+{
+	tcp_arg(pcb, NULL);
+	tcp_sent(pcb, NULL);
+	tcp_recv(pcb, NULL);
+	tcp_err(pcb, NULL);
+	tcp_poll(pcb, NULL, 0);
+	tcp_abort(pcb);
+
+	return ERR_ABRT;
+}
+
+
+static inline uint32_t time_ms(void)
+{
+	return to_ms_since_boot(get_absolute_time());
+}
+
+
+static void tcp_server_set_timer(telnet_session_t *ss, uint32_t ms)
+{
+	async_context_t *context = cyw43_arch_async_context();
+
+	async_context_remove_at_time_worker(context, &ss->timer_worker);
+	async_context_add_at_time_worker_in_ms(context, &ss->timer_worker, ms);
+	ss->timer_set = true;
+}
+
+
+#ifndef TELNETD_NO_AUTH
+static telnet_auth_t* tcp_server_get_auth(telnet_session_t *ss)
+{
+	tcp_server_t *st = ss->server;
+
+	if (ss->auth)
+		return ss->auth;
+
+	for (int i = 0; i < st->auth_slots; i++) {
+		if (!st->auth_pool[i].owner) {
+			ss->auth = &st->auth_pool[i];
+			ss->auth->owner = ss;
+			ss->auth->start = time_ms();
+			ss->auth->login[0] = 0;
+			return ss->auth;
+		}
+	}
+
+	return NULL;
+}
+
+
+static void tcp_server_put_auth(telnet_session_t *ss)
+{
+	if (!ss->auth)
+		return;
+
+	memset(ss->auth->login, 0, sizeof(ss->auth->login));
+	ss->auth->owner = NULL;
+	ss->auth = NULL;
+}
+#endif
+
+
+static void tcp_server_release_client(telnet_session_t *ss)
+{
+	tcp_server_t *st = ss->server;
+
+	async_context_remove_at_time_worker(cyw43_arch_async_context(), &ss->timer_worker);
+	ss->timer_set = false;
+	if (ss->flush_pending) {
+		async_context_remove_at_time_worker(cyw43_arch_async_context(), &ss->flush_worker);
+		ss->flush_pending = false;
+	}
+	if (ss->rx_queue) {
+		pbuf_free(ss->rx_queue);
+		ss->rx_queue = NULL;
+	}
+	ss->client = NULL;
+	ss->work_pending = false;
+	ss->replaying = false;
+#ifndef TELNETD_NO_AUTH
+	ss->resume_token = 0;
+#endif
+	if ((ss->cstate == CS_CONNECT || ss->cstate == CS_DETACHED) && st->on_disconnect) {
+		ss->cstate = CS_NONE;
+		st->on_disconnect(st->cb_param, ss);
+	}
+	ss->cstate = CS_NONE;
+#ifndef TELNETD_NO_AUTH
+	tcp_server_put_auth(ss);
+#endif
+}
+
+
+/* Schedule timer to check for idle (and login) timeout (unless timer is already needed for something else). */
+static void tcp_server_set_idle_timer(telnet_session_t *ss)
+{
+	tcp_server_t *st = ss->server;
+	uint32_t now = time_ms();
+	uint32_t wait = UINT32_MAX;
+
+	if (ss->timer_set)
+		return;
+
+	if (st->idle_timeout > 0) {
+		uint32_t idle = now - ss->last_input_time;
+		wait = (idle < st->idle_timeout * 1000 ? st->idle_timeout * 1000 - idle : 0);
+	}
+#ifndef TELNETD_NO_AUTH
+	if (ss->auth && st->login_timeout > 0) {
+		/* Login buffer is held only for login_timeout */
+		uint32_t t = now - ss->auth->start;
+		uint32_t left = (t < st->login_timeout * 1000 ? st->login_timeout * 1000 - t : 0);
+		if (left < wait)
+			wait = left;
+	}
+#endif
+
+	if (wait != UINT32_MAX)
+		tcp_server_set_timer(ss, wait);
+}
+
+
+/* Connection was lost (pcb is gone), keep session and undelivered output for resume_grace seconds
+   so that client can resume the session. Returns false if session is not resumable. */
+static bool tcp_server_detach_client(telnet_session_t *ss)
+{
+#ifndef TELNETD_NO_AUTH
+	tcp_server_t *st = ss->server;
+
+	if (st->resume_grace == 0 || ss->cstate != CS_CONNECT || ss->resume_token == 0)
+		return false;
+
+	ss->client = NULL;
+	ss->cstate = CS_DETACHED;
+	ss->work_pending = false;
+	if (ss->flush_pending) {
+		async_context_remove_at_time_worker(cyw43_arch_async_context(), &ss->flush_worker);
+		ss->flush_pending = false;
+	}
+	if (ss->rx_queue) {
+		pbuf_free(ss->rx_queue);
+		ss->rx_queue = NULL;
+	}
+	tcp_server_set_timer(ss, st->resume_grace * 1000);
+	LOG_MSG(LOG_INFO, "Session detached (%u bytes of output pending)",
+		telnet_ringbuffer_size(&ss->rb_out));
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+static void tcp_server_set_connected(telnet_session_t *ss)
+{
+	tcp_server_t *st = ss->server;
+
+	tcp_server_set_idle_timer(ss);
+	ss->cstate = CS_CONNECT;
+	ss->drop_count = 0; /* Shared with login state */
+	ss->at_line_start = true;
+	ss->line_received = false; /* Login/password lines do not count (NOTIFY_LINE) */
+#ifndef TELNETD_NO_LINEEDIT
+	if (st->editors)
+		telnet_lineedit_reset(&st->editors[ss - st->sessions]);
+#endif
+#ifndef TELNETD_NO_STDIO
+	if (st == stdio_tcpserv && telnet_ringbuffer_size(&st->history) > 0) {
+		/* Send console history first, from the timer so that it follows any pending output */
+		ss->replay_pos = st->history_total - telnet_ringbuffer_size(&st->history);
+		ss->replaying = true;
+		tcp_server_set_timer(ss, 0);
+	}
+#endif
+	if (st->on_connect)
+		st->on_connect(st->cb_param, ss);
+}
+
+
 static err_t tcp_server_close(void *arg) {
 	tcp_server_t *st = (tcp_server_t*)arg;
 	err_t err = ERR_OK;
@@ -146,12 +540,18 @@ static err_t tcp_server_close(void *arg) {
 	if (!arg)
 		return ERR_VAL;
 
-	st->cstate = CS_NONE;
-	if (st->client) {
-		err = close_client_connection(st->client);
-		st->client = NULL;
-		st->login[0] = 0;
+	for_each_session(st, ss) {
+		if (ss->client)
+			err = close_client_connection(ss->client);
+		tcp_server_release_client(ss);
 	}
+#ifndef TELNETD_NO_AUTH
+	if (st->pending) {
+		if (st->pending->client)
+			close_client_connection(st->pending->client);
+		tcp_server_release_client(st->pending);
+	}
+#endif
 
 	if (st->listen) {
 		tcp_arg(st->listen, NULL);
@@ -163,28 +563,89 @@ static err_t tcp_server_close(void *arg) {
 		}
 		st->listen = NULL;
 	}
+	async_context_remove_when_pending_worker(cyw43_arch_async_context(), &st->input_worker);
 
 	return err;
 }
 
 
+static bool tcp_server_is_interactive(telnet_session_t *ss, size_t waiting)
+{
+	switch (ss->server->nagle_mode) {
+	case NAGLE_ENABLED:
+		return false;
+	case NAGLE_DISABLED:
+		return true;
+	default:
+		break;
+	}
+
+	/* Small writes shortly after client input (keystroke echo, prompts)... */
+	return (waiting <= TELNET_INTERACTIVE_MAX_LEN
+		&& time_ms() - ss->last_input_time < TELNET_INTERACTIVE_WINDOW_MS);
+}
+
+
+static void tcp_server_update_nagle(telnet_session_t *ss, size_t waiting)
+{
+	tcp_server_t *st = ss->server;
+	bool interactive = tcp_server_is_interactive(ss, waiting);
+
+	if (interactive != ss->interactive)
+		LOG_MSG(LOG_DEBUG, "tcp_server_update_nagle: %s mode",
+			interactive ? "interactive" : "bulk");
+	ss->interactive = interactive;
+
+	if (interactive)
+		tcp_nagle_disable(ss->client);
+	else
+		tcp_nagle_enable(ss->client);
+}
+
+
+#ifndef TELNETD_NO_STDIO
+static bool tcp_server_defer_flush(telnet_session_t *ss)
+{
+	size_t waiting = telnet_ringbuffer_size(&ss->rb_out);
+
+	if (ss->server->nagle_mode != NAGLE_AUTO || !ss->client)
+		return false;
+	if (tcp_server_is_interactive(ss, waiting))
+		return false;
+
+	/* Bulk output: let data accumulate in rb_out while previous segments
+	   are in flight, remaining data gets flushed from the "sent" callback. */
+	return (ss->client->unacked && waiting < tcp_mss(ss->client));
+}
+#endif
+
+
+static int tcp_server_flush_buffer(telnet_session_t *ss);
+
 static err_t tcp_server_sent(void *arg, struct tcp_pcb *pcb, u16_t len)
 {
-	tcp_server_t *st = (tcp_server_t*)arg;
+	telnet_session_t *ss = (telnet_session_t*)arg;
+	tcp_server_t *st = ss->server;
 
 	LOG_MSG(LOG_DEBUG, "tcp_server_sent: %u", len);
+
+	if (ss->cstate == CS_CONNECT && (ss->replaying || telnet_ringbuffer_size(&ss->rb_out) > 0))
+		tcp_server_flush_buffer(ss);
+
 	return ERR_OK;
 }
 
 
-static void process_telnet_cmd(tcp_server_t *st)
+#ifndef TELNETD_NO_TELNET_MODE
+static void process_telnet_cmd(telnet_session_t *ss)
 {
+	tcp_server_t *st = ss->server;
 	int resp = -1;
 
 
-	switch(st->telnet_cmd) {
+	switch(ss->telnet_cmd) {
 	case TELNET_DO:
-		switch (st->telnet_opt) {
+		switch (ss->telnet_opt) {
 		case TO_ECHO:
 			/* do nothing since we sent WILL for these...*/
 			break;
@@ -201,7 +662,7 @@ static void process_telnet_cmd(tcp_server_t *st)
 		break;
 
 	case TELNET_WILL:
-		switch (st->telnet_opt) {
+		switch (ss->telnet_opt) {
 		case TO_SUP_GA:
 			/* do nothing since we sent DO for these... */
 			break;
@@ -229,179 +690,922 @@ static void process_telnet_cmd(tcp_server_t *st)
 		break;
 
 	default:
-		LOG_MSG(LOG_DEBUG, "Unknown telnet command: %d\n", st->telnet_cmd);
+		LOG_MSG(LOG_DEBUG, "Unknown telnet command: %d\n", ss->telnet_cmd);
 		break;
 	}
 
 
 	if (resp >= 0) {
-		uint8_t buf[3] = { IAC, resp, st->telnet_opt };
-		tcp_write(st->client, buf, 3, TCP_WRITE_FLAG_COPY);
+		uint8_t buf[3] = { IAC, resp, ss->telnet_opt };
+		tcp_write(ss->client, buf, 3, TCP_WRITE_FLAG_COPY);
 	}
 
-	st->telnet_cmd_count++;
+	if (ss->telnet_cmd_count < UINT8_MAX)
+		ss->telnet_cmd_count++;
 }
 
 
-static err_t process_received_data(void *arg, uint8_t *buf, size_t len)
+/* Run telnet protocol state machine for one received byte.
+   Returns the byte if it is (application) data, or -1 if it was consumed
+   by the telnet protocol. */
+static int telnet_decode_char(telnet_session_t *ss, uint8_t c)
 {
-	tcp_server_t *st = (tcp_server_t*)arg;
+	if (ss->telnet_state == 0) { /* normal (pass-through) mode */
+		if (c == IAC) {
+			ss->telnet_state = 1;
+			return -1;
+		}
+	}
+	else if (ss->telnet_state == 1) { /* IAC seen */
+		if (c == IAC) { /* escaped 0xff */
+			ss->telnet_state = 0;
+		}
+		else { /* Telnet command */
+			ss->telnet_cmd = c;
+			ss->telnet_opt = 0;
+			if (c == TELNET_WILL || c == TELNET_WONT
+				|| c == TELNET_DO || c == TELNET_DONT
+				|| c== TELNET_SB) {
+				ss->telnet_state = 2;
+			} else {
+				process_telnet_cmd(ss);
+				ss->telnet_state = 0;
+			}
+			return -1;
+		}
+	}
+	else if (ss->telnet_state == 2) { /* Telnet option */
+		ss->telnet_opt = c;
+		if (ss->telnet_cmd == TELNET_SB) {
+			ss->telnet_state = 3;
+		} else {
+			process_telnet_cmd(ss);
+			ss->telnet_state = 0;
+		}
+		return -1;
+	}
+	else if (ss->telnet_state == 3) { /* Subnegotiation data */
+		if (c == IAC)
+			ss->telnet_state = 4;
+		return -1;
+	}
+	else if (ss->telnet_state == 4) { /* subnegotiation end? */
+		if (c == IAC) {
+			ss->telnet_state = 3;
+			return -1;
+		}
+		ss->telnet_state = 1;
+		return telnet_decode_char(ss, c);
+	}
+	else {
+		ss->telnet_state = 0;
+	}
 
-	if (!arg || !buf)
-		return ERR_VAL;
+	if (ss->telnet_prev == 13 && c == 0) { // skip NUL after CR...
+		ss->telnet_prev = c;
+		return -1;
+	}
+	ss->telnet_prev = c;
+
+	return c;
+}
 
-	if (len < 1)
-		return ERR_OK;
 
-	telnet_ringbuffer_t *rb = &st->rb_in;
+/* Decode telnet protocol in place, data bytes are compacted to the beginning of the buffer.
+   Returns number of data bytes left in the buffer. */
+static size_t telnet_decode_inplace(telnet_session_t *ss, uint8_t *buf, size_t len)
+{
+	size_t w = 0;
+	int c;
 
+	for (size_t i = 0; i < len; i++) {
+		if ((c = telnet_decode_char(ss, buf[i])) >= 0)
+			buf[w++] = c;
+	}
 
-	for(int i = 0; i < len; i++) {
-		uint8_t c = buf[i];
+	return w;
+}
+#endif
 
-		if (st->mode == TELNET_MODE) {
-		telnet_state_macine:
-			if (st->telnet_state == 0) { /* normal (pass-through) mode */
-				if (c == IAC) {
-					st->telnet_state = 1;
-					continue;
-				}
-			}
-			else if (st->telnet_state == 1) { /* IAC seen */
-				if (c == IAC) { /* escaped 0xff */
-					st->telnet_state = 0;
-				}
-				else { /* Telnet command */
-					st->telnet_cmd = c;
-					st->telnet_opt = 0;
-					if (c == TELNET_WILL || c == TELNET_WONT
-						|| c == TELNET_DO || c == TELNET_DONT
-						|| c== TELNET_SB) {
-						st->telnet_state = 2;
-					} else {
-						process_telnet_cmd(st);
-						st->telnet_state = 0;
-					}
-					continue;
-				}
-			}
-			else if (st->telnet_state == 2) { /* Telnet option */
-				st->telnet_opt = c;
-				if (st->telnet_cmd == TELNET_SB) {
-					st->telnet_state = 3;
-				} else {
-					process_telnet_cmd(st);
-					st->telnet_state = 0;
-				}
-				continue;
-			}
-			else if (st->telnet_state == 3) { /* Subnegotiation data */
-				if (c == IAC)
-					st->telnet_state = 4;
-				continue;
-			}
-			else if (st->telnet_state == 4) { /* subnegotiation end? */
-				if (c == IAC)
-					st->telnet_state = 3;
-				else {
-					st->telnet_state = 1;
-					goto telnet_state_macine;
-				}
-			}
-			else {
-				st->telnet_state = 0;
-			}
 
-			if (st->telnet_prev == 13 && c == 0) { // skip NUL after CR...
-				st->telnet_prev = c;
-				continue;
-			}
-			st->telnet_prev = c;
-		}
+typedef struct echo_buf {
+	telnet_session_t *ss;
+	size_t len;
+	uint8_t buf[64];
+} echo_buf_t;
 
-		if (st->cstate == CS_AUTH_LOGIN) {
-			/* Echo back characters when in login prompt... */
-			char buf[1];
-			buf[0] = c;
-			tcp_write(st->client, buf, 1, TCP_WRITE_FLAG_COPY);
-			tcp_output(st->client);
-		}
-		if (telnet_ringbuffer_add_char(rb, c, false) < 0)
-			return ERR_MEM;
+static void flush_echo(echo_buf_t *eb)
+{
+	telnet_session_t *ss = eb->ss;
+
+	if (eb->len == 0)
+		return;
+
+	if (ss->cstate == CS_CONNECT && telnet_ringbuffer_size(&ss->rb_out) > 0) {
+		/* Keep echo in order with application output that is still queued */
+		telnet_ringbuffer_add(&ss->rb_out, eb->buf, eb->len, false);
+		tcp_server_flush_buffer(ss);
+	} else if (tcp_write(ss->client, eb->buf, eb->len, TCP_WRITE_FLAG_COPY) == ERR_OK) {
+		ss->tx_pending = true;
+		ss->at_line_start = (eb->buf[eb->len - 1] == '\r' || eb->buf[eb->len - 1] == '\n');
 	}
+	eb->len = 0;
+}
 
-	return ERR_OK;
+
+static void echo_out(void *ctx, const uint8_t *buf, size_t len)
+{
+	echo_buf_t *eb = (echo_buf_t*)ctx;
+
+	while (len > 0) {
+		size_t n = sizeof(eb->buf) - eb->len;
+
+		if (n > len)
+			n = len;
+		memcpy(eb->buf + eb->len, buf, n);
+		eb->len += n;
+		buf += n;
+		len -= n;
+		if (eb->len >= sizeof(eb->buf))
+			flush_echo(eb);
+	}
 }
 
 
-static err_t authenticate_connection(tcp_server_t *st)
+static inline telnet_lineedit_t* session_editor(telnet_session_t *ss)
 {
-	int i;
-	int l = -1;
-	int len = telnet_ringbuffer_size(&st->rb_in);
+#ifndef TELNETD_NO_LINEEDIT
+	if (ss->server->editors && ss->cstate == CS_CONNECT)
+		return &ss->server->editors[ss - ss->server->sessions];
+#endif
+	return NULL;
+}
+
+
+/* Add received data to rb_in (through line editor if enabled). With decode, telnet protocol
+   is decoded first (data is not already decoded). Returns number of bytes processed. */
+static size_t process_received_data(telnet_session_t *ss, const uint8_t *buf, size_t len, bool decode)
+{
+	telnet_ringbuffer_t *rb = &ss->rb_in;
+	telnet_lineedit_t *le = session_editor(ss);
+	echo_buf_t echo = { .ss = ss, .len = 0 };
+	size_t i;
+	int c;
+
+	if (!buf || len < 1)
+		return 0;
 
-	for (i = 0; i < len; i++) {
-		int c = telnet_ringbuffer_peek_char(&st->rb_in, i);
-		if (c == 10 || c == 13) {
-			l = i;
+
+	for(i = 0; i < len; i++) {
+		/* Stop when input buffer is full, rest of the data is left in the receive queue. */
+		if (rb->free < 1 || (le && rb->free < le->len + 1u))
 			break;
+
+		c = buf[i];
+#ifndef TELNETD_NO_TELNET_MODE
+		if (decode && (c = telnet_decode_char(ss, c)) < 0)
+			continue;
+#endif
+
+		if (le) {
+			int res = telnet_lineedit_input(le, c, echo_out, &echo);
+
+			if (res == TELNET_LINEEDIT_LINE) {
+				telnet_ringbuffer_add(rb, le->line, le->len, false);
+				telnet_ringbuffer_add_char(rb, '\n', false);
+				telnet_lineedit_accept(le);
+				ss->line_received = true;
+			} else if (res == TELNET_LINEEDIT_PASS) {
+				telnet_ringbuffer_add_char(rb, c, false);
+			}
+			continue;
 		}
-	}
-	if (l < 0)
-		return ERR_OK;
 
-	if (st->cstate == CS_AUTH_LOGIN) {
-		if (l >= sizeof(st->login))
-			l = sizeof(st->login) - 1;
-		telnet_ringbuffer_read(&st->rb_in, st->login, l+1);
-		st->login[l] = 0;
-		st->cstate = CS_AUTH_PASSWD;
-		tcp_write(st->client, telnet_passwd_prompt, strlen(telnet_passwd_prompt), 0);
-		tcp_output(st->client);
-	} else if (st->cstate == CS_AUTH_PASSWD) {
-		if (l >= sizeof(st->passwd))
-			l = sizeof(st->passwd) - 1;
-		telnet_ringbuffer_read(&st->rb_in, st->passwd, l+1);
-		st->passwd[l] = 0;
-		if (st->auth_cb(st->auth_cb_param, (const char*)st->login, (const char*)st->passwd) == 0) {
-			st->cstate = CS_CONNECT;
-			tcp_write(st->client, telnet_login_success,
-				strlen(telnet_login_success), 0);
-			LOG_MSG(LOG_NOTICE, "Successful login: %s (%s)",
-				st->login, ip4addr_ntoa(&st->client->remote_ip));
-		} else {
-			st->cstate = CS_ACCEPT;
-			tcp_write(st->client, telnet_login_failed,
-				strlen(telnet_login_failed), 0);
-			LOG_MSG(LOG_WARNING, "Login failure: %s (%s)",
-				st->login, ip4addr_ntoa(&st->client->remote_ip));
-			st->login_failure_count++;
-			st->login_delay = st->login_failure_count * 2;
+		if (ss->cstate == CS_AUTH_LOGIN) {
+			/* Echo back characters when in login prompt (sent in one write)... */
+			uint8_t ch = c;
+			echo_out(&echo, &ch, 1);
+		}
+		else if ((c == 10 || c == 13) && ss->cstate == CS_CONNECT) {
+			ss->line_received = true;
 		}
-		tcp_output(st->client);
-		memset(st->passwd, 0, sizeof(st->passwd));
+		if (telnet_ringbuffer_add_char(rb, c, false) < 0)
+			break;
 	}
 
-	telnet_ringbuffer_flush(&st->rb_in);
+	flush_echo(&echo);
 
-	return ERR_OK;
+	return i;
 }
 
 
-static err_t tcp_server_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+#ifndef TELNETD_NO_AUTH
+/* Returns offset of first line terminator in rb_in, or -1 if no complete line has been received. */
+static int find_line_end(telnet_ringbuffer_t *rb)
 {
-	tcp_server_t *st = (tcp_server_t*)arg;
-	struct pbuf *buf;
-	size_t len;
+	int len = telnet_ringbuffer_size(rb);
 
-	if (!p) {
-		/* Connection closed by client */
+	for (int i = 0; i < len; i++) {
+		int c = telnet_ringbuffer_peek_char(rb, i);
+		if (c == 10 || c == 13)
+			return i;
+	}
+
+	return -1;
+}
+
+
+static void tcp_server_process_input(telnet_session_t *ss);
+#ifndef TELNETD_NO_AUTH
+static telnet_session_t* tcp_server_claim_session(telnet_session_t *ps);
+#endif
+
+static void tcp_server_send_resume_token(telnet_session_t *ss)
+{
+	char buf[64];
+	int len;
+
+	do {
+		ss->resume_token = get_rand_64();
+	} while (ss->resume_token == 0);
+
+	len = snprintf(buf, sizeof(buf), "\r\nResume token: %s%016" PRIx64 "\r\n",
+		TELNET_RESUME_PREFIX, ss->resume_token);
+	ss->at_line_start = true;
+	tcp_write(ss->client, buf, len, TCP_WRITE_FLAG_COPY);
+}
+
+
+/* Move connection (and its telnet protocol state) from session ss (at login prompt) to session rs. */
+static void tcp_server_move_client(telnet_session_t *ss, telnet_session_t *rs)
+{
+	struct tcp_pcb *pcb = ss->client;
+
+	rs->client = pcb;
+	tcp_arg(pcb, rs);
+	rs->rx_queue = ss->rx_queue;
+	ss->rx_queue = NULL;
+	rs->telnet_state = ss->telnet_state;
+	rs->telnet_cmd = ss->telnet_cmd;
+	rs->telnet_opt = ss->telnet_opt;
+	rs->telnet_prev = ss->telnet_prev;
+	rs->telnet_cmd_count = ss->telnet_cmd_count;
+	rs->negotiation_done = ss->negotiation_done;
+	rs->last_input_time = ss->last_input_time;
+	rs->interactive = false;
+	rs->tx_pending = false;
+	rs->input_notified = false;
+
+	ss->client = NULL;
+	tcp_server_release_client(ss);
+}
+
+
+/* Move connection of session ss (at login prompt) into the session matching resume token.
+   Returns the resumed session, or NULL if token was not valid. */
+static telnet_session_t* tcp_server_resume_session(telnet_session_t *ss, const char *token)
+{
+	tcp_server_t *st = ss->server;
+	telnet_session_t *rs = NULL;
+	struct tcp_pcb *pcb = ss->client;
+	uint64_t t = 0;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		char c = token[i];
+		int v;
+
+		if (c >= '0' && c <= '9')
+			v = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			v = c - 'a' + 10;
+		else
+			return NULL;
+		t = (t << 4) | v;
+	}
+	if (token[i] != 0 || t == 0)
+		return NULL;
+
+	for_each_session(st, s) {
+		if (s != ss && s->resume_token == t
+			&& (s->cstate == CS_DETACHED || s->cstate == CS_CONNECT))
+			rs = s;
+	}
+	if (!rs)
+		return NULL;
+
+	LOG_MSG(LOG_NOTICE, "Session resumed: %s:%u",
+		ip4addr_ntoa(&pcb->remote_ip), pcb->remote_port);
+
+	/* Old connection may still be around (client roamed without closing it) */
+	if (rs->client) {
+		abort_client_connection(rs->client);
+		rs->client = NULL;
+		if (rs->rx_queue) {
+			pbuf_free(rs->rx_queue);
+			rs->rx_queue = NULL;
+		}
+	}
+	async_context_remove_at_time_worker(cyw43_arch_async_context(), &rs->timer_worker);
+	rs->timer_set = false;
+
+	/* Partial input from the old connection is stale... */
+	telnet_ringbuffer_flush(&rs->rb_in);
+#ifndef TELNETD_NO_LINEEDIT
+	if (st->editors)
+		telnet_lineedit_reset(&st->editors[rs - st->sessions]);
+#endif
+
+	rs->cstate = CS_CONNECT;
+	tcp_server_move_client(ss, rs);
+
+	/* ...but data client sent after the token line (already decoded) belongs to the resumed session */
+	while (telnet_ringbuffer_size(&ss->rb_in) > 0) {
+		uint8_t *ptr;
+		size_t n = telnet_ringbuffer_peek_at(&ss->rb_in, 0, &ptr, telnet_ringbuffer_size(&ss->rb_in));
+
+		process_received_data(rs, ptr, n, false);
+		telnet_ringbuffer_read(&ss->rb_in, NULL, n);
+	}
+
+	/* Token is valid only once */
+	tcp_server_send_resume_token(rs);
+	tcp_output(pcb);
+	tcp_server_flush_buffer(rs);
+	tcp_server_set_idle_timer(rs);
+	if (rs->rx_queue)
+		tcp_server_process_input(rs);
+
+	return rs;
+}
+
+
+static void tcp_server_login_failed(telnet_session_t *ss, const uint8_t *login)
+{
+	tcp_server_t *st = ss->server;
+
+	ss->cstate = CS_ACCEPT;
+	tcp_write(ss->client, telnet_login_failed,
+		strlen(telnet_login_failed), 0);
+	LOG_MSG(LOG_WARNING, "Login failure: %s (%s)",
+		login, ip4addr_ntoa(&ss->client->remote_ip));
+	ss->login_failure_count++;
+	ss->login_delay = ss->login_failure_count * TELNET_LOGIN_DELAY_MS;
+	tcp_server_set_timer(ss, ss->login_delay);
+}
+
+
+static err_t authenticate_connection(telnet_session_t *ss)
+{
+	tcp_server_t *st = ss->server;
+	uint8_t passwd[MAX_PASSWORD_LENGTH + 1];
+	uint8_t *login = ss->auth->login;
+	telnet_session_t *ps = ss;
+	int l = find_line_end(&ss->rb_in);
+
+	if (l < 0) {
+		if (ss->rb_in.free < 1) {
+			/* Discard too long line, so that receive window does not stay closed. */
+			telnet_ringbuffer_flush(&ss->rb_in);
+		}
+		return ERR_OK;
+	}
+
+	if (ss->cstate == CS_AUTH_LOGIN) {
+		if ((size_t)l >= sizeof(ss->auth->login))
+			l = sizeof(ss->auth->login) - 1;
+		telnet_ringbuffer_read(&ss->rb_in, login, l+1);
+		/* LF of CR LF is not part of the data that follows */
+		if (login[l] == 13 && telnet_ringbuffer_peek_char(&ss->rb_in, 0) == 10)
+			telnet_ringbuffer_read_char(&ss->rb_in);
+		login[l] = 0;
+		if (st->resume_grace > 0 && !strncmp((char*)login, TELNET_RESUME_PREFIX,
+							strlen(TELNET_RESUME_PREFIX))) {
+			const char *token = (char*)login + strlen(TELNET_RESUME_PREFIX);
+
+			if (tcp_server_resume_session(ss, token))
+				return ERR_OK;
+			tcp_server_login_failed(ss, login);
+			tcp_output(ss->client);
+			telnet_ringbuffer_flush(&ss->rb_in);
+			return ERR_OK;
+		}
+		ss->cstate = CS_AUTH_PASSWD;
+		tcp_write(ss->client, telnet_passwd_prompt, strlen(telnet_passwd_prompt), 0);
+		tcp_output(ss->client);
+	} else if (ss->cstate == CS_AUTH_PASSWD) {
+		if ((size_t)l >= sizeof(passwd))
+			l = sizeof(passwd) - 1;
+		telnet_ringbuffer_read(&ss->rb_in, passwd, l+1);
+		passwd[l] = 0;
+		if (st->auth_cb(st->auth_cb_param, (const char*)login, (const char*)passwd) == 0) {
+			LOG_MSG(LOG_NOTICE, "Successful login: %s (%s)",
+				login, ip4addr_ntoa(&ss->client->remote_ip));
+			if (ss == st->pending && !(ss = tcp_server_claim_session(ps))) {
+				/* Logged in from takeover slot, but there was no session to take over */
+				LOG_MSG(LOG_NOTICE, "No free sessions, disconnecting client: %s:%u",
+					ip4addr_ntoa(&ps->client->remote_ip), ps->client->remote_port);
+				tcp_write(ps->client, telnet_no_sessions, strlen(telnet_no_sessions), 0);
+				memset(passwd, 0, sizeof(passwd));
+				close_client_connection(ps->client);
+				tcp_server_release_client(ps);
+				return ERR_OK;
+			}
+			tcp_server_set_connected(ss);
+			tcp_write(ss->client, telnet_login_success,
+				strlen(telnet_login_success), 0);
+			if (st->resume_grace > 0)
+				tcp_server_send_resume_token(ss);
+		} else {
+			tcp_server_login_failed(ss, login);
+		}
+		tcp_output(ss->client);
+		memset(passwd, 0, sizeof(passwd));
+		/* After failed login, login buffer is kept for next attempt (until login_timeout) */
+		if (ss->cstate == CS_CONNECT)
+			tcp_server_put_auth(ss);
+	}
+
+	telnet_ringbuffer_flush(&ss->rb_in);
+
+	/* Connection moved from takeover slot, continue with data client sent ahead */
+	if (ss != ps && ss->rx_queue)
+		tcp_server_process_input(ss);
+
+	return ERR_OK;
+}
+#endif
+
+
+static inline void work_begin(tcp_server_t *st)
+{
+	st->work_start = time_us_32();
+	st->work_bytes = 0;
+}
+
+
+static inline void work_end(tcp_server_t *st)
+{
+	uint32_t t = time_us_32() - st->work_start;
+
+	if (t > st->max_callback_us)
+		st->max_callback_us = t;
+}
+
+
+static inline bool work_budget_enabled(tcp_server_t *st)
+{
+	return (st->work_budget_bytes > 0 || st->work_budget_us > 0);
+}
+
+
+/* Budget of current callback (or worker run) has been used up */
+static inline bool work_budget_used(tcp_server_t *st)
+{
+	return ((st->work_budget_bytes > 0 && st->work_bytes >= st->work_budget_bytes)
+		|| (st->work_budget_us > 0 && time_us_32() - st->work_start >= st->work_budget_us));
+}
+
+
+static void work_defer(telnet_session_t *ss)
+{
+	ss->work_pending = true;
+	async_context_set_work_pending(cyw43_arch_async_context(), &ss->server->input_worker);
+}
+
+
+/* Check if work budget of current callback has been used up. If so,
+   schedule rest of the work to be done from the input worker. */
+static bool work_exhausted(telnet_session_t *ss)
+{
+	if (work_budget_used(ss->server)) {
+		work_defer(ss);
+		return true;
+	}
+
+	return false;
+}
+
+
+static inline size_t work_bytes_left(tcp_server_t *st, size_t len)
+{
+	if (st->work_budget_bytes > 0 && len > st->work_budget_bytes - st->work_bytes)
+		return st->work_budget_bytes - st->work_bytes;
+	return len;
+}
+
+
+/* Open receive window, tcp_recved() only takes u16_t so larger amounts are done in steps. */
+static void tcp_server_recved(struct tcp_pcb *pcb, size_t len)
+{
+	while (len > 0) {
+		u16_t n = (len > 0xffff ? 0xffff : len);
+
+		tcp_recved(pcb, n);
+		len -= n;
+	}
+}
+
+
+/* Remove data from the head of receive queue, pbufs are released as they become empty.
+   Returns number of bytes consumed (caller is responsible for calling tcp_server_recved()). */
+static size_t rx_queue_consume(telnet_session_t *ss, size_t len)
+{
+	size_t left = len;
+	struct pbuf *p;
+
+	while ((p = ss->rx_queue) != NULL && (left > 0 || p->len == 0)) {
+		if (left < p->len) {
+			pbuf_remove_header(p, left);
+			left = 0;
+			break;
+		}
+		left -= p->len;
+		ss->rx_queue = p->next;
+		p->next = NULL;
+		pbuf_free(p);
+	}
+
+	return len - left;
+}
+
+
+static void rx_queue_add(telnet_session_t *ss, struct pbuf *p)
+{
+	tcp_server_t *st = ss->server;
+	size_t dropped = 0;
+
+	if (!st->rx_zero_copy) {
+		if (ss->rx_queue)
+			pbuf_cat(ss->rx_queue, p);
+		else
+			ss->rx_queue = p;
+		return;
+	}
+
+	/* Zero-copy mode: split chain into individual pbufs and decode telnet protocol
+	   in place, so that readers can consume data directly from the pbufs. */
+	while (p) {
+		struct pbuf *q = p;
+
+		p = q->next;
+		q->next = NULL;
+		q->tot_len = q->len;
+
+#ifndef TELNETD_NO_TELNET_MODE
+		if (st->mode == TELNET_MODE) {
+			size_t len = q->len;
+			size_t w = telnet_decode_inplace(ss, q->payload, len);
+
+			if (w < len) {
+				/* Move data next to the end of payload and drop protocol bytes from front */
+				memmove((uint8_t*)q->payload + (len - w), q->payload, w);
+				pbuf_remove_header(q, len - w);
+				dropped += len - w;
+			}
+		}
+#endif
+
+		if (st->notify_mode == NOTIFY_LINE && (memchr(q->payload, 10, q->len)
+							|| memchr(q->payload, 13, q->len)))
+			ss->line_received = true;
+
+		if (q->len == 0) {
+			pbuf_free(q);
+		} else if (ss->rx_queue) {
+			pbuf_cat(ss->rx_queue, q);
+		} else {
+			ss->rx_queue = q;
+		}
+	}
+
+	/* Telnet protocol bytes are consumed immediately... */
+	if (dropped > 0 && ss->client)
+		tcp_server_recved(ss->client, dropped);
+}
+
+
+static size_t tcp_server_input_available(telnet_session_t *ss)
+{
+	size_t len = telnet_ringbuffer_size(&ss->rb_in);
+
+	if (ss->server->rx_zero_copy && ss->cstate == CS_CONNECT && ss->rx_queue)
+		len += ss->rx_queue->tot_len;
+
+	return len;
+}
+
+
+/* Deliver received data to on_data callback, directly from the pbufs. */
+static void tcp_server_deliver_input(telnet_session_t *ss)
+{
+	tcp_server_t *st = ss->server;
+	struct pbuf *p;
+	uint8_t *rbuf;
+	size_t len;
+	size_t consumed = 0;
+
+	/* Data buffered before connection was established... */
+	while ((len = telnet_ringbuffer_peek(&ss->rb_in, &rbuf, ss->rb_in.size)) > 0) {
+		st->on_data(st->cb_param, ss, rbuf, len);
+		if (ss->cstate != CS_CONNECT)
+			return;
+		telnet_ringbuffer_read(&ss->rb_in, NULL, len);
+	}
+
+	while ((p = ss->rx_queue) != NULL) {
+		size_t plen = p->len;
+
+		if (work_exhausted(ss))
+			break;
+		st->work_bytes += plen;
+		len = plen;
+#ifndef TELNETD_NO_TELNET_MODE
+		if (st->mode == TELNET_MODE && !st->rx_zero_copy)
+			len = telnet_decode_inplace(ss, p->payload, plen);
+#endif
+		if (len > 0) {
+			st->on_data(st->cb_param, ss, p->payload, len);
+			/* Check if callback disconnected the client... */
+			if (ss->rx_queue != p || ss->cstate != CS_CONNECT)
+				break;
+		}
+		consumed += rx_queue_consume(ss, plen);
+	}
+
+	if (consumed > 0 && ss->client)
+		tcp_server_recved(ss->client, consumed);
+}
+
+
+static void tcp_server_process_input(telnet_session_t *ss)
+{
+	tcp_server_t *st = ss->server;
+	struct pbuf *p;
+	size_t total = 0;
+	bool again;
+#ifndef TELNETD_NO_TELNET_MODE
+	bool decode = (st->mode == TELNET_MODE && !st->rx_zero_copy);
+#else
+	bool decode = false;
+#endif
+
+	do {
+		again = false;
+
+		if (ss->cstate == CS_CONNECT && st->on_data) {
+			tcp_server_deliver_input(ss);
+			break;
+		}
+
+		/* Move data from receive queue into rb_in as long as there is space.
+		   In zero-copy mode, connected clients' data is left in the queue. */
+		while ((p = ss->rx_queue) != NULL && ss->rb_in.free > 0
+			&& !(st->rx_zero_copy && ss->cstate == CS_CONNECT)) {
+			if (work_exhausted(ss))
+				break;
+
+			size_t len = work_bytes_left(st, p->len);
+			size_t n = process_received_data(ss, p->payload, len, decode);
+
+			st->work_bytes += n;
+			total += rx_queue_consume(ss, n);
+			if (n < len)
+				break;
+		}
+
+#ifndef TELNETD_NO_AUTH
+		if (telnet_ringbuffer_size(&ss->rb_in) > 0
+			&& (ss->cstate == CS_AUTH_LOGIN || ss->cstate == CS_AUTH_PASSWD)) {
+			bool passwd = (ss->cstate == CS_AUTH_PASSWD && work_budget_enabled(st)
+					&& find_line_end(&ss->rb_in) >= 0);
+			if (passwd && (!st->in_worker || work_exhausted(ss))) {
+				/* Run (potentially slow) authentication callback from the worker,
+				   at most one per worker run. */
+				if (!st->in_worker)
+					work_defer(ss);
+				break;
+			}
+			/* Authentication may move connection to another session (resume), so
+			   open receive window for the data consumed so far first. */
+			if (total > 0 && ss->client) {
+				tcp_server_recved(ss->client, total);
+				total = 0;
+			}
+			authenticate_connection(ss);
+			if (passwd) {
+				/* Password hashing counts as a full budget */
+				st->work_bytes = st->work_budget_bytes;
+				if (st->work_budget_us > 0)
+					st->work_start = time_us_32() - st->work_budget_us;
+			}
+			again = (ss->rx_queue && (telnet_ringbuffer_size(&ss->rb_in) == 0
+							|| ss->cstate == CS_CONNECT));
+		}
+#endif
+	} while (again);
+
+	/* Open receive window only for the data that was actually consumed. */
+	if (total > 0 && ss->client)
+		tcp_server_recved(ss->client, total);
+
+	/* In recv callback, output is done once at the end (along with the ACK). */
+	if (ss->tx_pending && !ss->in_recv && ss->client) {
+		tcp_output(ss->client);
+		ss->tx_pending = false;
+	}
+
+	telnet_lineedit_t *le = session_editor(ss);
+	if (ss->rx_queue && (ss->rb_in.free < 1 || (le && ss->rb_in.free < le->len + 1u))
+		&& ss->cstate == CS_CONNECT && !st->rx_zero_copy && !st->on_data && ss->client) {
+		/* Application has not yet read rb_in, check again later... */
+		tcp_server_set_timer(ss, TCP_RX_RETRY_MS);
+	}
+}
+
+
+/* Move new connection from CS_ACCEPT state to login prompt (or directly to connected state).
+   In TELNET_MODE this is done as soon as client has responded to the negotiation. */
+static void tcp_server_begin_session(telnet_session_t *ss)
+{
+	tcp_server_t *st = ss->server;
+	int wcount = 0;
+
+	if (ss->cstate != CS_ACCEPT || !ss->client)
+		return;
+	if (ss->login_delay > 0 || ss->login_failure_count >= MAX_LOGIN_FAILURES)
+		return;
+
+#ifndef TELNETD_NO_TELNET_MODE
+	if (st->mode == TELNET_MODE && !ss->negotiation_done) {
+		if (ss->telnet_cmd_count == 0 || ss->telnet_state != 0)
+			return;
+		ss->negotiation_done = true;
+		async_context_remove_at_time_worker(cyw43_arch_async_context(), &ss->timer_worker);
+		ss->timer_set = false;
+	}
+#endif
+
+	if (st->banner && !ss->banner_displayed) {
+		tcp_write(ss->client, st->banner, strlen(st->banner), TCP_WRITE_FLAG_COPY);
+		ss->banner_displayed = true;
+		wcount++;
+	}
+#ifndef TELNETD_NO_AUTH
+	if (st->auth_cb) {
+		/* Login buffer was reserved when connection was accepted */
+		ss->cstate = CS_AUTH_LOGIN;
+		tcp_server_set_idle_timer(ss);
+		tcp_write(ss->client, telnet_login_prompt, strlen(telnet_login_prompt), 0);
+		wcount++;
+	} else
+#endif
+	{
+		tcp_server_set_connected(ss);
+	}
+
+	if (wcount > 0 && ss->client)
+		tcp_output(ss->client);
+
+	/* Process any input that client sent ahead (scripted logins)... */
+	if (ss->rx_queue || telnet_ringbuffer_size(&ss->rb_in) > 0)
+		tcp_server_process_input(ss);
+}
+
+
+/* Call chars_available_callback according to notify_mode. */
+static void tcp_server_notify_input(telnet_session_t *ss, bool timeout)
+{
+#ifndef TELNETD_NO_STDIO
+	tcp_server_t *st = ss->server;
+	size_t avail;
+	bool notify;
+
+	if (ss->cstate != CS_CONNECT || !chars_available_callback || st != stdio_tcpserv)
+		return;
+	if ((avail = tcp_server_input_available(ss)) == 0) {
+		ss->input_notified = false;
+		return;
+	}
+
+	switch (st->notify_mode) {
+	case NOTIFY_EDGE:
+		notify = !ss->input_notified;
+		break;
+	case NOTIFY_LINE:
+		notify = (ss->line_received || timeout);
+		break;
+	case NOTIFY_THRESHOLD:
+		notify = (avail >= st->notify_threshold || timeout);
+		break;
+	default:
+		notify = true;
+		break;
+	}
+
+	/* Always notify if input has stalled because buffer is full */
+	if (!st->rx_zero_copy && ss->rb_in.free < 1)
+		notify = true;
+
+	if (!notify) {
+		if (st->notify_timeout > 0 && !ss->notify_timer_armed) {
+			tcp_server_set_timer(ss, st->notify_timeout);
+			ss->notify_timer_armed = true;
+		}
+		return;
+	}
+
+	ss->input_notified = true;
+	ss->line_received = false;
+	chars_available_callback(chars_available_param);
+#endif
+}
+
+
+/* Single one-shot timer per connection handles negotiation timeout, login delay, idle and
+   login timeouts, retrying input processing when rb_in is full, notification timeout
+   (notify_mode), continuing stdio history replay, and expiry of detached sessions. */
+static void tcp_server_timer_worker(async_context_t *context, async_at_time_worker_t *worker)
+{
+	telnet_session_t *ss = (telnet_session_t*)worker->user_data;
+	tcp_server_t *st = ss->server;
+
+	if (ss->cstate == CS_DETACHED) {
+		LOG_MSG(LOG_NOTICE, "Detached session expired");
+		tcp_server_release_client(ss);
+		return;
+	}
+	if (!ss->client)
+		return;
+
+	work_begin(st);
+	ss->timer_set = false;
+
+	if (ss->cstate != CS_ACCEPT && st->idle_timeout > 0
+		&& time_ms() - ss->last_input_time >= st->idle_timeout * 1000) {
+		LOG_MSG(LOG_NOTICE, "Idle timeout, disconnecting client: %s:%u",
+			ip4addr_ntoa(&ss->client->remote_ip), ss->client->remote_port);
+		abort_client_connection(ss->client);
+		tcp_server_release_client(ss);
+		work_end(st);
+		return;
+	}
+
+#ifndef TELNETD_NO_AUTH
+	if (ss->auth && st->login_timeout > 0
+		&& time_ms() - ss->auth->start >= st->login_timeout * 1000) {
+		LOG_MSG(LOG_NOTICE, "Login timeout, disconnecting client: %s:%u",
+			ip4addr_ntoa(&ss->client->remote_ip), ss->client->remote_port);
+		close_client_connection(ss->client);
+		tcp_server_release_client(ss);
+		work_end(st);
+		return;
+	}
+#endif
+
+	if (ss->cstate == CS_ACCEPT) {
+		if (ss->login_failure_count >= MAX_LOGIN_FAILURES) {
+			LOG_MSG(LOG_NOTICE, "Too many login failures, disconnecting client: %s:%u",
+				ip4addr_ntoa(&ss->client->remote_ip), ss->client->remote_port);
+			close_client_connection(ss->client);
+			tcp_server_release_client(ss);
+			work_end(st);
+			return;
+		}
+		/* Login delay has passed, or client did not respond to telnet negotiation... */
+		ss->login_delay = 0;
+		ss->negotiation_done = true;
+		tcp_server_begin_session(ss);
+	}
+	else if (ss->cstate == CS_CONNECT) {
+		/* Pick up queued data in case application reads rb_in directly */
+		if (ss->rx_queue)
+			tcp_server_process_input(ss);
+		ss->notify_timer_armed = false;
+		tcp_server_notify_input(ss, true);
+		if (ss->replaying)
+			tcp_server_flush_buffer(ss);
+	}
+
+	if (ss->client && ss->cstate != CS_ACCEPT)
+		tcp_server_set_idle_timer(ss);
+
+	work_end(st);
+}
+
+
+static err_t tcp_server_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+	telnet_session_t *ss = (telnet_session_t*)arg;
+	tcp_server_t *st = ss->server;
+
+	if (!p) {
+		/* Connection closed by client */
 		LOG_MSG(LOG_INFO, "Client closed connection: %s:%u (%d)",
 			ip4addr_ntoa(&pcb->remote_ip), pcb->remote_port, err);
 		close_client_connection(pcb);
-		st->cstate = CS_NONE;
-		st->client = NULL;
-		st->login[0] = 0;
+		if (!tcp_server_detach_client(ss))
+			tcp_server_release_client(ss);
 		return ERR_OK;
 	}
 	if (err != ERR_OK) {
@@ -415,387 +1619,1549 @@ static err_t tcp_server_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err
 
 	LOG_MSG(LOG_DEBUG, "tcp_server_recv: data received (pcb=%x): tot_len=%d, len=%d, err=%d",
 		pcb, p->tot_len, p->len, err);
+	ss->last_input_time = time_ms();
 
 
-	buf = p;
-	while (buf != NULL) {
-		err = process_received_data(st, buf->payload, buf->len);
-		if  (err != ERR_OK)
-			break;
-		buf = buf->next;
-	}
+	work_begin(st);
+	ss->in_recv = true;
 
-	if ((len = telnet_ringbuffer_size(&st->rb_in)) > 0) {
-		if (st->cstate == CS_AUTH_LOGIN || st->cstate == CS_AUTH_PASSWD) {
-			authenticate_connection(st);
-		}
-		else if (st->cstate == CS_CONNECT && chars_available_callback) {
-			chars_available_callback(chars_available_param);
-		}
+	/* Input buffer was drained since last notification (edge-triggered notify) */
+	if (tcp_server_input_available(ss) == 0)
+		ss->input_notified = false;
+
+	/* Queue received data, tcp_server_recved() gets called as data is consumed... */
+	rx_queue_add(ss, p);
+	tcp_server_process_input(ss);
+	if (ss->cstate == CS_ACCEPT)
+		tcp_server_begin_session(ss);
+	tcp_server_notify_input(ss, false);
+
+	ss->in_recv = false;
+	if (ss->tx_pending && ss->client) {
+		tcp_output(ss->client);
+		ss->tx_pending = false;
 	}
 
-	tcp_recved(pcb, p->tot_len);
-	pbuf_free(p);
+	work_end(st);
+
+	return ERR_OK;
+}
+
+
+/* Continue deferred work of a session. Returns false if budget has been used up. */
+static bool input_worker_session(telnet_session_t *ss)
+{
+	tcp_server_t *st = ss->server;
+
+	if (!ss->work_pending)
+		return true;
+	if (work_budget_used(st)) {
+		async_context_set_work_pending(cyw43_arch_async_context(), &st->input_worker);
+		return false;
+	}
+	ss->work_pending = false;
+	if (ss->client) {
+		tcp_server_process_input(ss);
+		tcp_server_notify_input(ss, false);
+	}
+
+	return true;
+}
+
+
+static void tcp_server_input_worker(async_context_t *context, async_when_pending_worker_t *worker)
+{
+	tcp_server_t *st = (tcp_server_t*)worker->user_data;
+	bool more = true;
+
+	/* Budget is shared by all sessions, the rest is continued on next run */
+	work_begin(st);
+	st->in_worker = true;
+	for_each_session(st, ss) {
+		if (!(more = input_worker_session(ss)))
+			break;
+	}
+#ifndef TELNETD_NO_AUTH
+	if (more && st->pending)
+		input_worker_session(st->pending);
+#endif
+	st->in_worker = false;
+	work_end(st);
+}
+
+
+/* Output rate limiter (token bucket shared by all sessions of the server).
+   Returns how many of len bytes can be sent now. */
+static size_t tcp_server_rate_allow(telnet_session_t *ss, size_t len)
+{
+	tcp_server_t *st = ss->server;
+	uint32_t burst, gain;
+	uint64_t now, elapsed, fill;
+
+	if (st->rate_limit == 0)
+		return len;
+
+	burst = (st->rate_burst > 0 ? st->rate_burst : st->rate_limit);
+	now = time_us_64();
+	elapsed = now - st->rate_time;
+	/* Time to fill the whole bucket, no need to look further back than that */
+	fill = (uint64_t)burst * 1000000 / st->rate_limit;
+	gain = (elapsed >= fill ? burst : elapsed * st->rate_limit / 1000000);
+	if (st->rate_tokens + (uint64_t)gain >= burst) {
+		st->rate_tokens = burst;
+		st->rate_time = now;
+	} else if (gain > 0) {
+		st->rate_tokens += gain;
+		/* Keep the fraction of a token earned so far */
+		st->rate_time += (uint64_t)gain * 1000000 / st->rate_limit;
+	}
+
+	if (st->rate_throttled && st->rate_tokens > 0) {
+		st->throttled_ms += (now - st->throttle_start + 500) / 1000;
+		st->rate_throttled = false;
+	}
+
+	if (st->rate_tokens == 0) {
+		if (!st->rate_throttled) {
+			st->rate_throttled = true;
+			st->throttle_start = now;
+			st->throttle_count++;
+		}
+		/* Retry when there are enough tokens for a reasonably sized segment */
+		if (!ss->flush_pending) {
+			size_t want = len;
+			if (want > burst)
+				want = burst;
+			if (want > tcp_mss(ss->client))
+				want = tcp_mss(ss->client);
+			if (async_context_add_at_time_worker_in_ms(cyw43_arch_async_context(), &ss->flush_worker,
+								want * 1000 / st->rate_limit + 1))
+				ss->flush_pending = true;
+		}
+		return 0;
+	}
+
+	return (len < st->rate_tokens ? len : st->rate_tokens);
+}
+
+
+static inline void tcp_server_rate_consume(tcp_server_t *st, size_t len)
+{
+	if (st->rate_limit > 0)
+		st->rate_tokens -= len;
+}
+
+
+/* Skip queued status line rewrites and screen redraws that would be overwritten by
+   newer ones (also queued) anyway, so that slow client gets the current state sooner. */
+static void tcp_server_coalesce_output(telnet_session_t *ss)
+{
+	tcp_server_t *st = ss->server;
+	telnet_ringbuffer_t *rb = &ss->rb_out;
+	size_t skip = 0;
+	int o;
+
+	if (st->coalesce_mode == COALESCE_CR_HOME && telnet_coalesce_find_home(rb, 0) == 0) {
+		/* Skip to the last queued redraw */
+		while ((o = telnet_coalesce_find_home(rb, skip + 1)) > 0)
+			skip = o;
+	} else if (ss->at_line_start) {
+		/* Drop "old\r" when it is followed by "new\r" that covers at least the same length */
+		size_t len = telnet_coalesce_cr_frame(rb, 0);
+
+		while (len > 0) {
+			size_t next = telnet_coalesce_cr_frame(rb, skip + len);
+
+			if (next < len)
+				break;
+			skip += len;
+			len = next;
+		}
+	}
+
+	if (skip > 0) {
+		telnet_ringbuffer_read(rb, NULL, skip);
+		ss->drop_count = 0;
+		st->tx_coalesced += skip;
+	}
+}
+
+
+#ifndef TELNETD_NO_STDIO
+/* Send stdio history directly from the (shared) history buffer, without staging it in rb_out.
+   Returns true once session has caught up with history_total. */
+static bool tcp_server_replay_history(telnet_session_t *ss)
+{
+	tcp_server_t *st = ss->server;
+	uint32_t used = telnet_ringbuffer_size(&st->history);
+	uint32_t oldest = st->history_total - used;
+	uint8_t *rbuf;
+	int wcount = 0;
+
+	if ((int32_t)(ss->replay_pos - oldest) < 0) {
+		LOG_MSG(LOG_INFO, "History overwritten during replay, %u bytes lost",
+			(unsigned int)(oldest - ss->replay_pos));
+		ss->replay_pos = oldest;
+	}
+
+	while (ss->replay_pos != st->history_total) {
+		size_t space = tcp_server_rate_allow(ss, tcp_sndbuf(ss->client));
+		size_t len = telnet_ringbuffer_peek_at(&st->history, ss->replay_pos - oldest, &rbuf, space);
+
+		if (len == 0)
+			break;
+		/* lwIP copies the span: history is written with overwrite (stdio output never blocks),
+		   so a span referenced without copy could change before it is acknowledged. */
+		if (tcp_write(ss->client, rbuf, len, TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE) != ERR_OK)
+			break;
+		tcp_server_rate_consume(st, len);
+		ss->replay_pos += len;
+		ss->at_line_start = (rbuf[len - 1] == '\r' || rbuf[len - 1] == '\n');
+		wcount++;
+	}
+
+	if (wcount > 0)
+		tcp_output(ss->client);
+	if (ss->replay_pos == st->history_total)
+		ss->replaying = false;
+
+	return !ss->replaying;
+}
+#endif
+
+
+static int tcp_server_flush_buffer(telnet_session_t *ss)
+{
+	uint8_t *rbuf;
+	int waiting;
+	int wcount = 0;
+
+	if (!ss)
+		return -1;
+
+	if (ss->cstate != CS_CONNECT)
+		return 0;
+
+#ifndef TELNETD_NO_STDIO
+	if (ss->replaying && !tcp_server_replay_history(ss))
+		return 0;
+#endif
+
+	if (ss->server->coalesce_mode != COALESCE_NONE)
+		tcp_server_coalesce_output(ss);
+
+	if ((waiting = telnet_ringbuffer_size(&ss->rb_out)) > 0)
+		tcp_server_update_nagle(ss, waiting);
+
+	while ((waiting = telnet_ringbuffer_size(&ss->rb_out)) > 0) {
+		size_t len = tcp_server_rate_allow(ss, waiting);
+		if (len > 0)
+			len = telnet_ringbuffer_peek(&ss->rb_out, &rbuf, len);
+		if (len > 0) {
+			u8_t flags = TCP_WRITE_FLAG_COPY;
+			if (len < (size_t)waiting)
+				flags |= TCP_WRITE_FLAG_MORE;
+			err_t err = tcp_write(ss->client, rbuf, len, flags);
+			if (err != ERR_OK)
+				break;
+			tcp_server_rate_consume(ss->server, len);
+			ss->at_line_start = (rbuf[len - 1] == '\r' || rbuf[len - 1] == '\n');
+			telnet_ringbuffer_read(&ss->rb_out, NULL, len);
+			ss->drop_count = 0;
+			wcount++;
+		} else {
+			break;
+		}
+	}
+
+	if (wcount > 0 || ss->tx_pending) {
+		tcp_output(ss->client);
+		ss->tx_pending = false;
+	}
+
+	return wcount;
+}
+
+
+static void tcp_server_flush_worker(async_context_t *context, async_at_time_worker_t *worker)
+{
+	telnet_session_t *ss = (telnet_session_t*)worker->user_data;
+
+	ss->flush_pending = false;
+	tcp_server_flush_buffer(ss);
+}
+
+
+static void tcp_server_schedule_flush(telnet_session_t *ss)
+{
+	if (ss->flush_pending)
+		return;
+
+	if (ss->server->flush_delay == 0) {
+		tcp_server_flush_buffer(ss);
+		return;
+	}
+
+	/* Coalesce writes that happen within flush_delay into single flush... */
+	if (async_context_add_at_time_worker_in_ms(cyw43_arch_async_context(),
+							&ss->flush_worker, ss->server->flush_delay))
+		ss->flush_pending = true;
+}
+
+
+enum { ESC_NONE = 0, ESC_ESC, ESC_CSI, ESC_STR };
+
+static inline int output_byte(telnet_ringbuffer_t *rb, size_t used, const uint8_t *data, size_t offset)
+{
+	return (offset < used ? telnet_ringbuffer_peek_char(rb, offset) : data[offset - used]);
+}
+
+
+/* Find where to cut (rb_out followed by new data) so that at least needed bytes are dropped.
+   Prefer start of a line, otherwise a position that is not inside an escape sequence or
+   UTF-8 character. */
+static size_t tcp_server_overflow_cut(telnet_ringbuffer_t *rb, const uint8_t *data, size_t len, size_t needed)
+{
+	size_t used = telnet_ringbuffer_size(rb);
+	size_t total = used + len;
+	size_t limit = (needed + TELNET_OVERFLOW_SCAN < total ? needed + TELNET_OVERFLOW_SCAN : total);
+	size_t record = 0;
+	int esc = ESC_NONE;
+	int prev = 0;
+
+	for (size_t o = 0; o < limit; o++) {
+		int c = output_byte(rb, used, data, o);
+
+		if (o >= needed) {
+			if (prev == '\n')
+				return o;
+			if (!record && esc == ESC_NONE && (c & 0xc0) != 0x80)
+				record = o;
+		}
+
+		switch (esc) {
+		case ESC_NONE:
+			if (c == 0x1b)
+				esc = ESC_ESC;
+			break;
+		case ESC_ESC:
+			if (c == '[')
+				esc = ESC_CSI;
+			else if (c == ']' || c == 'P' || c == '_' || c == '^')
+				esc = ESC_STR;
+			else if (c < 0x20 || c > 0x2f)
+				esc = ESC_NONE;
+			break;
+		case ESC_CSI:
+			if (c >= 0x40 && c <= 0x7e)
+				esc = ESC_NONE;
+			break;
+		case ESC_STR:
+			/* OSC/DCS strings end with BEL or ST (ESC \) */
+			if (c == 0x07)
+				esc = ESC_NONE;
+			else if (c == 0x1b)
+				esc = ESC_ESC;
+			break;
+		}
+		prev = c;
+	}
+
+	/* If no clean boundary was found, drop everything */
+	return (record ? record : total);
+}
+
+
+/* OVERFLOW_EVICT: drop oldest output (and new data if needed) so that data, and reserve bytes
+   more, fit in rb_out along with overflow marker. Returns number of bytes dropped. */
+static size_t tcp_server_evict_output(telnet_session_t *ss, const uint8_t **data, size_t *len, size_t reserve)
+{
+	telnet_ringbuffer_t *rb = &ss->rb_out;
+	size_t used = telnet_ringbuffer_size(rb);
+	unsigned long dropped = 0;
+	char marker[TELNET_DROP_MARKER_MAX + 1];
+	size_t cut, old_len = 0;
+	int mlen;
+
+	if (rb->free >= *len + reserve)
+		return 0;
+	if (rb->size <= TELNET_DROP_MARKER_MAX + reserve) {
+		/* No room for marker, just drop new data */
+		dropped = *len;
+		*len = 0;
+		return dropped;
+	}
+
+	cut = tcp_server_overflow_cut(rb, *data, *len, used + *len + reserve + TELNET_DROP_MARKER_MAX - rb->size);
+	if (ss->drop_count > 0) {
+		/* Merge with previous marker (at the start of rb_out, always within cut) */
+		dropped = ss->drop_count;
+		old_len = snprintf(NULL, 0, TELNET_DROP_MARKER, dropped);
+	}
+	dropped += cut - old_len;
+
+	if (cut <= used) {
+		telnet_ringbuffer_read(rb, NULL, cut);
+	} else {
+		telnet_ringbuffer_flush(rb);
+		*data += cut - used;
+		*len -= cut - used;
+	}
+
+	ss->drop_count = 0;
+	mlen = snprintf(marker, sizeof(marker), TELNET_DROP_MARKER, dropped);
+	if (mlen > 0 && mlen <= TELNET_DROP_MARKER_MAX && telnet_ringbuffer_prepend(rb, (uint8_t*)marker, mlen) == 0)
+		ss->drop_count = dropped;
+
+	return cut - old_len;
+}
+
+
+/* OVERFLOW_EVICT: drop oldest output so that len bytes fit in rb_out (without cutting them).
+   Returns false if there is not enough space (or overflow_mode does not allow evicting). */
+static bool tcp_server_evict_space(telnet_session_t *ss, size_t len)
+{
+	const uint8_t *data = NULL;
+	size_t n = 0;
+
+	if (ss->rb_out.free >= len)
+		return true;
+	if (ss->server->overflow_mode != OVERFLOW_EVICT)
+		return false;
+	ss->server->tx_dropped += tcp_server_evict_output(ss, &data, &n, len);
+
+	return (ss->rb_out.free >= len);
+}
+
+
+static err_t tcp_server_poll(void *arg, struct tcp_pcb *pcb)
+{
+	telnet_session_t *ss = (telnet_session_t*)arg;
+	tcp_server_t *st = ss->server;
+
+
+	work_begin(st);
+
+	if (ss->rx_queue || (st->on_data && ss->cstate == CS_CONNECT
+				&& telnet_ringbuffer_size(&ss->rb_in) > 0)) {
+		/* Pick up queued data in case application reads rb_in directly */
+		tcp_server_process_input(ss);
+	}
+
+	if (st->auto_flush && ss->cstate == CS_CONNECT) {
+		tcp_server_flush_buffer(ss);
+	}
+
+	work_end(st);
+
+	return ERR_OK;
+}
+
+
+static void tcp_server_err(void *arg, err_t err)
+{
+	telnet_session_t *ss = (telnet_session_t*)arg;
+	tcp_server_t *st;
+
+	if (!ss)
+		return;
+	st = ss->server;
+
+	if (err != ERR_ABRT)
+		LOG_MSG(LOG_ERR,"tcp_server_err: client connection error: %d", err);
+
+	/* pcb has already been freed by lwIP, release the session slot (or keep it for resume) */
+	ss->client = NULL;
+	if (!tcp_server_detach_client(ss))
+		tcp_server_release_client(ss);
+}
+
+
+static telnet_session_t* tcp_server_alloc_session(tcp_server_t *st)
+{
+	for_each_session(st, ss) {
+		if (ss->cstate == CS_NONE && !ss->client)
+			return ss;
+	}
+
+	return NULL;
+}
+
+
+static bool tcp_server_session_stale(telnet_session_t *ss)
+{
+	tcp_server_t *st = ss->server;
+
+	/* Detached session, or peer not acknowledging data (retransmitting repeatedly)... */
+	if (!ss->client || ss->client->nrtx >= TELNET_STALE_RETRANSMITS)
+		return true;
+
+	return (st->takeover_idle > 0
+		&& time_ms() - ss->last_input_time >= st->takeover_idle * 1000);
+}
+
+
+/* Free up a session for new connection (when all sessions are in use) according to takeover_mode. */
+static telnet_session_t* tcp_server_takeover_session(tcp_server_t *st)
+{
+	telnet_session_t *victim = NULL;
+	uint32_t now = time_ms();
+
+	if (st->takeover_mode == TAKEOVER_NONE)
+		return NULL;
+
+	for_each_session(st, ss) {
+		if (!ss->client && ss->cstate != CS_DETACHED)
+			continue;
+		if (st->takeover_mode == TAKEOVER_STALE && !tcp_server_session_stale(ss))
+			continue;
+		if (!victim || now - ss->last_input_time > now - victim->last_input_time)
+			victim = ss;
+	}
+
+	if (victim) {
+		if (victim->client) {
+			LOG_MSG(LOG_NOTICE, "Session takeover, disconnecting client: %s:%u",
+				ip4addr_ntoa(&victim->client->remote_ip), victim->client->remote_port);
+			abort_client_connection(victim->client);
+		} else {
+			LOG_MSG(LOG_NOTICE, "Session takeover, releasing detached session");
+		}
+		tcp_server_release_client(victim);
+	}
+
+	return victim;
+}
+
+
+/* Initialize session for new connection. */
+static void tcp_server_reset_session(telnet_session_t *ss)
+{
+	ss->cstate = CS_ACCEPT;
+	ss->telnet_state = 0;
+	ss->telnet_cmd_count = 0;
+	ss->login_failure_count = 0;
+	ss->banner_displayed = false;
+	ss->negotiation_done = false;
+	ss->login_delay = 0;
+	ss->last_input_time = time_ms();
+	ss->timer_set = false;
+	ss->interactive = false;
+	ss->tx_pending = false;
+	ss->input_notified = false;
+	ss->line_received = false;
+	ss->notify_timer_armed = false;
+	telnet_ringbuffer_flush(&ss->rb_in);
+	telnet_ringbuffer_flush(&ss->rb_out);
+}
+
+
+#ifndef TELNETD_NO_AUTH
+/* Connection in takeover slot (ps) has logged in, move it to a free session, taking
+   over one according to takeover_mode if needed. Returns NULL if there is none. */
+static telnet_session_t* tcp_server_claim_session(telnet_session_t *ps)
+{
+	tcp_server_t *st = ps->server;
+	telnet_session_t *ss;
+
+	if (!(ss = tcp_server_alloc_session(st)) && !(ss = tcp_server_takeover_session(st)))
+		return NULL;
+
+	tcp_server_reset_session(ss);
+	tcp_server_move_client(ps, ss);
+
+	return ss;
+}
+#endif
+
+
+static err_t tcp_server_accept(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+	tcp_server_t *st = (tcp_server_t*)arg;
+	telnet_session_t *ss;
+
+
+	if (!pcb || err != ERR_OK) {
+		LOG_MSG(LOG_ERR, "tcp_server_accept: failure: %d", err);
+		return ERR_VAL;
+	}
+
+	LOG_MSG(LOG_NOTICE, "Client connected: %s:%u",
+		ip4addr_ntoa(&pcb->remote_ip), pcb->remote_port);
+
+	if (st->allow_connect_cb) {
+		if (st->allow_connect_cb(&pcb->remote_ip) <= 0) {
+			LOG_MSG(LOG_ERR, "tcp_server_accept: connection not allowed from: %s",
+				ip4addr_ntoa(&pcb->remote_ip));
+			return ERR_MEM;
+		}
+	}
+
+	if (!(ss = tcp_server_alloc_session(st))) {
+#ifndef TELNETD_NO_AUTH
+		/* With authentication, session is taken over only after successful login */
+		if (st->pending)
+			ss = (st->pending->cstate == CS_NONE ? st->pending : NULL);
+		else
+#endif
+			ss = tcp_server_takeover_session(st);
+	}
+	if (!ss) {
+		LOG_MSG(LOG_ERR, "tcp_server_accept: reject connection (no free sessions)");
+		return ERR_MEM;
+	}
+#ifndef TELNETD_NO_AUTH
+	/* Login buffer is reserved up front, so that login_timeout applies from the start */
+	if (st->auth_cb && !tcp_server_get_auth(ss)) {
+		LOG_MSG(LOG_ERR, "tcp_server_accept: reject connection (too many clients at login prompt)");
+		return ERR_MEM;
+	}
+#endif
+
+	ss->client = pcb;
+	tcp_arg(pcb, ss);
+	tcp_sent(pcb, tcp_server_sent);
+	tcp_recv(pcb, tcp_server_recv);
+	if (st->auto_flush) /* Periodic poll is only needed for auto_flush */
+		tcp_poll(pcb, tcp_server_poll, TCP_CLIENT_POLL_TIME);
+	tcp_err(pcb, tcp_server_err);
+
+	if (st->keepalive_idle > 0) {
+		ip_set_option(pcb, SOF_KEEPALIVE);
+		pcb->keep_idle = st->keepalive_idle * 1000;
+#if LWIP_TCP_KEEPALIVE
+		if (st->keepalive_interval > 0)
+			pcb->keep_intvl = st->keepalive_interval * 1000;
+		if (st->keepalive_count > 0)
+			pcb->keep_cnt = st->keepalive_count;
+#endif
+	}
+
+	tcp_server_reset_session(ss);
+
+#ifndef TELNETD_NO_TELNET_MODE
+	if (st->mode == TELNET_MODE) { /* Send Telnet "handshake"... */
+		tcp_write(pcb, telnet_default_options, sizeof(telnet_default_options), 0);
+		tcp_output(pcb);
+		tcp_server_set_timer(ss, TELNET_NEGOTIATION_TIMEOUT_MS);
+		return ERR_OK;
+	}
+#endif
+	tcp_server_begin_session(ss);
+
+	return ERR_OK;
+}
+
+
+static bool tcp_server_open(tcp_server_t *st) {
+	struct tcp_pcb *pcb;
+	err_t err;
+
+	if (!st)
+		return false;
+
+	if (!(pcb = tcp_new_ip_type(IPADDR_TYPE_ANY))) {
+		LOG_MSG(LOG_ERR, "tcp_server_open: failed to create pcb");
+		return false;
+	}
+
+	if ((err = tcp_bind(pcb, NULL, st->port)) != ERR_OK) {
+		LOG_MSG(LOG_ERR, "tcp_server_open: cannot bind to port %d: %d", st->port, err);
+		tcp_abort(pcb);
+		return false;
+	}
+
+	if (!(st->listen = tcp_listen_with_backlog(pcb, st->max_sessions))) {
+		LOG_MSG(LOG_ERR, "tcp_server_open: failed to listen on port %d", st->port);
+		tcp_abort(pcb);
+		return false;
+	}
+
+	tcp_arg(st->listen, st);
+	tcp_accept(st->listen, tcp_server_accept);
+	async_context_add_when_pending_worker(cyw43_arch_async_context(), &st->input_worker);
+
+	return true;
+}
+
+
+/* Read (decoded) input data from rb_in and (in zero-copy mode) directly from receive queue. */
+static size_t tcp_server_read_input(telnet_session_t *ss, uint8_t *buf, size_t len)
+{
+	size_t count = telnet_ringbuffer_size(&ss->rb_in);
+	size_t consumed = 0;
+
+	if (count > len)
+		count = len;
+	if (count > 0)
+		telnet_ringbuffer_read(&ss->rb_in, buf, count);
+
+	if (ss->server->rx_zero_copy && ss->cstate == CS_CONNECT) {
+		struct pbuf *p;
+
+		while (count < len && (p = ss->rx_queue) != NULL) {
+			size_t n = len - count;
+			if (n > p->len)
+				n = p->len;
+			memcpy(buf + count, p->payload, n);
+			count += n;
+			consumed += rx_queue_consume(ss, n);
+		}
+		if (consumed > 0 && ss->client)
+			tcp_server_recved(ss->client, consumed);
+	}
+
+	/* Called from application, so budget starts from here */
+	work_begin(ss->server);
+	tcp_server_process_input(ss);
+
+	return count;
+}
+
+
+/* Read input from connected sessions, starting from the session after the one that was read last. */
+static size_t tcp_server_read_any(tcp_server_t *st, uint8_t *buf, size_t len, uint8_t *next)
+{
+	size_t count = 0;
+
+	for (uint8_t i = 0; i < st->max_sessions && count == 0; i++) {
+		uint8_t idx = (*next + i) % st->max_sessions;
+		telnet_session_t *ss = &st->sessions[idx];
+
+		if (ss->cstate != CS_CONNECT)
+			continue;
+		if ((count = tcp_server_read_input(ss, buf, len)) > 0)
+			*next = (idx + 1) % st->max_sessions;
+	}
+
+	return count;
+}
+
+
+#ifndef TELNETD_NO_STDIO
+static void stdio_tcp_out_chars(const char *buf, int length)
+{
+	if (!stdio_tcpserv)
+		return;
+
+	cyw43_arch_lwip_begin();
+	if (stdio_tcpserv->history.size > 0) {
+		size_t skip = ((size_t)length > stdio_tcpserv->history.size ? length - stdio_tcpserv->history.size : 0);
+
+		telnet_ringbuffer_add(&stdio_tcpserv->history, (const uint8_t*)buf + skip, length - skip, true);
+		stdio_tcpserv->history_total += length;
+	}
+	for_each_session(stdio_tcpserv, ss) {
+		int count = 0;
+
+		/* Output to detached sessions is kept until session is resumed */
+		if (ss->cstate != CS_CONNECT && ss->cstate != CS_DETACHED)
+			continue;
+		/* Sessions still replaying history will get this output from there */
+		if (ss->replaying) {
+			if (ss->client)
+				tcp_server_flush_buffer(ss);
+			continue;
+		}
+		const uint8_t *data = (const uint8_t*)buf;
+		size_t len = length;
+		if (stdio_tcpserv->overflow_mode == OVERFLOW_EVICT)
+			stdio_tcpserv->tx_dropped += tcp_server_evict_output(ss, &data, &len, 0);
+		for (size_t i = 0; i < len; i++) {
+			if (telnet_ringbuffer_add_char(&ss->rb_out, data[i], false) < 0)
+				break;
+			count++;
+		}
+		stdio_tcpserv->tx_dropped += len - count;
+		if (count > 0 && !tcp_server_defer_flush(ss))
+			tcp_server_flush_buffer(ss);
+	}
+	cyw43_arch_lwip_end();
+}
+
+
+static int stdio_tcp_in_chars(char *buf, int length)
+{
+	int i = 0;
+
+	if (!stdio_tcpserv)
+		return PICO_ERROR_NO_DATA;
+
+	cyw43_arch_lwip_begin();
+	if (length > 0)
+		i = tcp_server_read_any(stdio_tcpserv, (uint8_t*)buf, length, &stdio_next_session);
+	cyw43_arch_lwip_end();
+
+	return i ? i : PICO_ERROR_NO_DATA;
+}
+
+
+static void stdio_tcp_set_chars_available_callback(void (*fn)(void*), void *param)
+{
+    chars_available_callback = fn;
+    chars_available_param = param;
+}
+
+
+stdio_driver_t stdio_tcp_driver = {
+	.out_chars = stdio_tcp_out_chars,
+	.in_chars = stdio_tcp_in_chars,
+	.set_chars_available_callback = stdio_tcp_set_chars_available_callback,
+	.crlf_enabled = PICO_STDIO_DEFAULT_CRLF
+};
+
+
+static void stdio_tcp_init(tcp_server_t *st)
+{
+	stdio_tcpserv = st;
+	stdio_next_session = 0;
+	chars_available_callback = NULL;
+	chars_available_param = NULL;
+	stdio_set_driver_enabled(&stdio_tcp_driver, true);
+}
+
+
+static void stdio_tcp_close(tcp_server_t *st)
+{
+	if (!stdio_tcpserv || stdio_tcpserv != st)
+		return;
+	stdio_set_driver_enabled(&stdio_tcp_driver, false);
+	stdio_tcpserv = NULL;
+	chars_available_callback = NULL;
+	chars_available_param = NULL;
+}
+#endif
+
+
+tcp_server_t* telnet_server_init(size_t rxbuf_size, size_t txbuf_size)
+{
+	return telnet_server_init_sessions(rxbuf_size, txbuf_size, TELNET_DEFAULT_MAX_SESSIONS);
+}
+
+
+tcp_server_t* telnet_server_init_sessions(size_t rxbuf_size, size_t txbuf_size, uint8_t max_sessions)
+{
+	return tcp_server_init(rxbuf_size > 0 ? rxbuf_size : TCP_DEFAULT_RXBUF_SIZE,
+			txbuf_size > 0 ? txbuf_size : TCP_DEFAULT_TXBUF_SIZE,
+			max_sessions > 0 ? max_sessions : TELNET_DEFAULT_MAX_SESSIONS);
+}
+
+
+bool telnet_server_start(tcp_server_t *st, bool stdio)
+{
+#ifdef TELNETD_NO_AUTH
+	bool auth = false;
+#else
+	bool auth = (st->auth_cb != NULL);
+#endif
+
+	if (st->rx_zero_copy) {
+		/* Input buffer is only needed for login (if authentication is enabled) */
+		for_each_session(st, ss) {
+#ifdef TELNETD_STATIC_ALLOC
+			/* Static buffer stays reserved, just limit it to login prompt use */
+			if (ss->rb_in.size > MAX_PASSWORD_LENGTH + 2)
+				telnet_ringbuffer_init(&ss->rb_in, ss->rb_in.buf,
+						auth ? MAX_PASSWORD_LENGTH + 2 : 0);
+#else
+			telnet_ringbuffer_free(&ss->rb_in);
+			if (auth && telnet_ringbuffer_init(&ss->rb_in, NULL, MAX_PASSWORD_LENGTH + 2)) {
+				LOG_MSG(LOG_ERR, "Failed to allocate login input buffer");
+				return false;
+			}
+#endif
+		}
+	}
+
+#ifndef TELNETD_NO_AUTH
+	if (auth && !st->auth_pool) {
+		/* One for each session, and for the takeover slot */
+		int slots = st->max_sessions + (st->takeover_mode != TAKEOVER_NONE ? 1 : 0);
+
+		if (TELNET_MAX_CONCURRENT_LOGINS > 0 && slots > TELNET_MAX_CONCURRENT_LOGINS)
+			slots = TELNET_MAX_CONCURRENT_LOGINS;
+		st->auth_slots = (slots > UINT8_MAX ? UINT8_MAX : slots);
+#ifdef TELNETD_STATIC_ALLOC
+		st->auth_pool = static_auth_pool;
+		memset(static_auth_pool, 0, sizeof(static_auth_pool));
+#else
+		if (!(st->auth_pool = telnetd_alloc(st->auth_slots * sizeof(telnet_auth_t),
+							_Alignof(telnet_auth_t), TELNETD_ALLOC_AUTH))) {
+			LOG_MSG(LOG_ERR, "Failed to allocate login buffers");
+			return false;
+		}
+#endif
+	}
+
+	if (auth && st->takeover_mode != TAKEOVER_NONE && !st->pending) {
+		/* Extra session (with just a small input buffer) for logging in before taking over */
+#ifdef TELNETD_STATIC_ALLOC
+		st->pending = &static_pending;
+		memset(st->pending, 0, sizeof(telnet_session_t));
+		telnet_ringbuffer_init(&st->pending->rb_in, static_pending_rxbuf, sizeof(static_pending_rxbuf));
+#else
+		if (!(st->pending = telnetd_alloc(sizeof(telnet_session_t), _Alignof(telnet_session_t),
+							TELNETD_ALLOC_SESSIONS))
+			|| telnet_ringbuffer_init(&st->pending->rb_in, NULL, MAX_PASSWORD_LENGTH + 2)) {
+			LOG_MSG(LOG_ERR, "Failed to allocate takeover session");
+			telnetd_free(st->pending, sizeof(telnet_session_t), TELNETD_ALLOC_SESSIONS);
+			st->pending = NULL;
+			return false;
+		}
+#endif
+		tcp_server_init_session(st, st->pending);
+	}
+#endif
+
+#ifndef TELNETD_NO_LINEEDIT
+	if (st->line_editor > 0 && !st->editors) {
+		if (st->rx_zero_copy || st->on_data) {
+			LOG_MSG(LOG_WARNING, "telnet_server_start: line editor not available with rx_zero_copy/on_data");
+		} else {
+#ifdef TELNETD_STATIC_ALLOC
+#if TELNETD_STATIC_LINE_SIZE > 0
+			if (st->line_editor > TELNETD_STATIC_LINE_SIZE || st->line_history > TELNETD_STATIC_LINE_HISTORY)
+				LOG_MSG(LOG_WARNING, "telnet_server_start: line editor limited to %u bytes (history %u bytes)",
+					TELNETD_STATIC_LINE_SIZE, TELNETD_STATIC_LINE_HISTORY);
+			st->editors = static_editors;
+			for_each_session(st, ss) {
+				int i = ss - st->sessions;
+				telnet_lineedit_init(&st->editors[i], static_editbuf[i],
+						st->line_editor < TELNETD_STATIC_LINE_SIZE ?
+						st->line_editor : TELNETD_STATIC_LINE_SIZE,
+						st->line_history < TELNETD_STATIC_LINE_HISTORY ?
+						st->line_history : TELNETD_STATIC_LINE_HISTORY);
+			}
+#else
+			LOG_MSG(LOG_WARNING, "telnet_server_start: line editor not available (TELNETD_STATIC_LINE_SIZE is 0)");
+#endif
+#else
+			st->editors = telnetd_alloc(st->max_sessions * sizeof(telnet_lineedit_t),
+						_Alignof(telnet_lineedit_t), TELNETD_ALLOC_LINEEDIT);
+			for_each_session(st, ss) {
+				if (!st->editors || telnet_lineedit_init(&st->editors[ss - st->sessions], NULL,
+								st->line_editor, st->line_history)) {
+					LOG_MSG(LOG_ERR, "Failed to allocate line editor");
+					tcp_server_free_editors(st);
+					return false;
+				}
+			}
+#endif
+		}
+	}
+#endif
+
+	cyw43_arch_lwip_begin();
+	bool res = tcp_server_open(st);
+	if (!res) {
+		tcp_server_close(st);
+	} else if (stdio) {
+#ifdef TELNETD_NO_STDIO
+		LOG_MSG(LOG_WARNING, "telnet_server_start: stdio support not available");
+#else
+		if (st->history_size > 0 && st->history.size == 0) {
+#ifdef TELNETD_STATIC_ALLOC
+			if (st->history_size > TELNETD_STATIC_HISTORY_SIZE)
+				LOG_MSG(LOG_WARNING, "telnet_server_start: history_size limited to %u bytes",
+					TELNETD_STATIC_HISTORY_SIZE);
+#if TELNETD_STATIC_HISTORY_SIZE > 0
+			telnet_ringbuffer_init(&st->history, static_history,
+					st->history_size < TELNETD_STATIC_HISTORY_SIZE ?
+					st->history_size : TELNETD_STATIC_HISTORY_SIZE);
+#endif
+#else
+			if (telnet_ringbuffer_init(&st->history, NULL, st->history_size))
+				LOG_MSG(LOG_WARNING, "telnet_server_start: failed to allocate history buffer");
+#endif
+			st->history_total = 0;
+		}
+		stdio_tcp_init(st);
+#endif
+	}
+	cyw43_arch_lwip_end();
+
+	return res;
+}
+
+
+void telnet_server_destroy(tcp_server_t *st)
+{
+	cyw43_arch_lwip_begin();
+#ifndef TELNETD_NO_STDIO
+	stdio_tcp_close(st);
+#endif
+	tcp_server_close(st);
+	cyw43_arch_lwip_end();
+	tcp_server_free_sessions(st);
+#ifndef TELNETD_NO_LINEEDIT
+	tcp_server_free_editors(st);
+#endif
+#ifndef TELNETD_NO_STDIO
+	telnet_ringbuffer_free(&st->history);
+#endif
+#ifdef TELNETD_STATIC_ALLOC
+	static_server_used = false;
+#endif
+#ifndef TELNETD_NO_AUTH
+	if (st->pending) {
+		telnet_ringbuffer_free(&st->pending->rb_in);
+#ifndef TELNETD_STATIC_ALLOC
+		telnetd_free(st->pending, sizeof(telnet_session_t), TELNETD_ALLOC_SESSIONS);
+#endif
+		st->pending = NULL;
+	}
+#ifndef TELNETD_STATIC_ALLOC
+	telnetd_free(st->auth_pool, st->auth_slots * sizeof(telnet_auth_t), TELNETD_ALLOC_AUTH);
+#endif
+	st->auth_pool = NULL;
+	st->auth_slots = 0;
+#endif
+}
+
+
+err_t telnet_server_flush_buffer(tcp_server_t *st)
+{
+	int res = 0;
+
+	cyw43_arch_lwip_begin();
+	for_each_session(st, ss) {
+		int r = tcp_server_flush_buffer(ss);
+		if (r > 0)
+			res += r;
+	}
+	cyw43_arch_lwip_end();
+
+	return res;
+}
+
+
+static err_t tcp_server_write(telnet_session_t *ss, const void *buf, size_t len)
+{
+	const uint8_t *data = buf;
+
+	if (ss->cstate != CS_CONNECT && ss->cstate != CS_DETACHED)
+		return ERR_CONN;
+	if (ss->server->overflow_mode == OVERFLOW_EVICT)
+		ss->server->tx_dropped += tcp_server_evict_output(ss, &data, &len, 0);
+	if (telnet_ringbuffer_add(&ss->rb_out, data, len, false) < 0)
+		return ERR_MEM;
+
+	tcp_server_schedule_flush(ss);
+
+	return ERR_OK;
+}
+
+
+/* Gather write: all fragments are queued, or none. If nothing is waiting in rb_out, fragments
+   are passed directly to tcp_write() (with MORE flag on all but the last one).
+   Direct path is taken only when rate limiter allows the whole message right now (tokens are
+   consumed for what gets written), so it never bypasses rate_limit. Overflow policy and
+   coalescing do not apply to it: rb_out is empty (nothing to evict or coalesce), and the
+   message has to fit in the TCP send buffer. Otherwise message is queued in rb_out like
+   any other output. */
+static err_t tcp_server_writev(telnet_session_t *ss, const telnet_iovec_t *iov, int iovcnt)
+{
+	size_t total = 0;
+	bool direct = false;
+	int i = 0;
+
+	if (ss->cstate != CS_CONNECT && ss->cstate != CS_DETACHED)
+		return ERR_CONN;
+
+	for (int j = 0; j < iovcnt; j++)
+		total += iov[j].iov_len;
+	if (total == 0)
+		return ERR_OK;
+	if (!tcp_server_evict_space(ss, total))
+		return ERR_MEM;
+
+	if (ss->cstate == CS_CONNECT && ss->client && !ss->replaying
+		&& telnet_ringbuffer_size(&ss->rb_out) == 0 && total <= tcp_sndbuf(ss->client)) {
+		/* Worst case number of pbufs tcp_write() adds to the send queue */
+		size_t segs = 0;
+		for (int j = 0; j < iovcnt; j++)
+			segs += iov[j].iov_len / tcp_mss(ss->client) + 1;
+		/* Rate limiter is checked last, it may schedule a retry */
+		direct = (tcp_sndqueuelen(ss->client) + segs <= TCP_SND_QUEUELEN
+			&& tcp_server_rate_allow(ss, total) == total);
+	}
+
+	if (direct) {
+		const uint8_t *last = NULL;
+
+		tcp_server_update_nagle(ss, total);
+		for (; i < iovcnt; i++) {
+			u8_t flags = TCP_WRITE_FLAG_COPY;
+
+			if (iov[i].iov_len == 0)
+				continue;
+			if (i < iovcnt - 1)
+				flags |= TCP_WRITE_FLAG_MORE;
+			if (tcp_write(ss->client, iov[i].iov_base, iov[i].iov_len, flags) != ERR_OK)
+				break;
+			tcp_server_rate_consume(ss->server, iov[i].iov_len);
+			last = (const uint8_t*)iov[i].iov_base + iov[i].iov_len - 1;
+			ss->tx_pending = true;
+		}
+		if (last)
+			ss->at_line_start = (*last == '\r' || *last == '\n');
+	}
+
+	/* Rest (if any) goes to rb_out, space was already checked above */
+	for (; i < iovcnt; i++)
+		telnet_ringbuffer_add(&ss->rb_out, iov[i].iov_base, iov[i].iov_len, false);
+
+	tcp_server_schedule_flush(ss);
+
+	return ERR_OK;
+}
+
+
+err_t telnet_server_write(tcp_server_t *st, const void *buf, size_t len)
+{
+	err_t res = ERR_CONN;
+
+	if (!st || !buf)
+		return ERR_ARG;
+
+	/* Write to all connected sessions */
+	cyw43_arch_lwip_begin();
+	for_each_session(st, ss) {
+		err_t err = tcp_server_write(ss, buf, len);
+		if (err != ERR_CONN && res != ERR_MEM)
+			res = err;
+	}
+	cyw43_arch_lwip_end();
+
+	return res;
+}
+
+
+err_t telnet_server_writev(tcp_server_t *st, const telnet_iovec_t *iov, int iovcnt)
+{
+	err_t res = ERR_CONN;
+
+	if (!st || !iov || iovcnt < 0)
+		return ERR_ARG;
+
+	cyw43_arch_lwip_begin();
+	for_each_session(st, ss) {
+		err_t err = tcp_server_writev(ss, iov, iovcnt);
+		if (err != ERR_CONN && res != ERR_MEM)
+			res = err;
+	}
+	cyw43_arch_lwip_end();
 
-	return ERR_OK;
+	return res;
 }
 
 
-static int tcp_server_flush_buffer(tcp_server_t *st)
+/* Format into rb_out, with OVERFLOW_EVICT old output is dropped if message does not fit.
+   Message is never cut. */
+static int tcp_server_format(telnet_session_t *ss, const char *format, va_list ap)
 {
-	uint8_t *rbuf;
-	int waiting;
-	int wcount = 0;
-
-	if (!st)
-		return -1;
-
-	if (st->cstate != CS_CONNECT)
-		return 0;
+	va_list ap2;
+	int len;
 
-	while ((waiting = telnet_ringbuffer_size(&st->rb_out)) > 0) {
-		size_t len = telnet_ringbuffer_peek(&st->rb_out, &rbuf, waiting);
-		if (len > 0) {
-			u8_t flags = TCP_WRITE_FLAG_COPY;
-			if (len < waiting)
-				flags |= TCP_WRITE_FLAG_MORE;
-			err_t err = tcp_write(st->client, rbuf, len, flags);
-			if (err != ERR_OK)
-				break;
-			telnet_ringbuffer_read(&st->rb_out, NULL, len);
-			wcount++;
-		} else {
-			break;
-		}
-	}
+	len = telnet_ringbuffer_vprintf(&ss->rb_out, format, ap);
+	if (len != -2 || ss->server->overflow_mode != OVERFLOW_EVICT)
+		return len;
 
-	if (wcount > 0)
-		tcp_output(st->client);
+	/* Room is needed for the terminating NUL too */
+	va_copy(ap2, ap);
+	len = vsnprintf(NULL, 0, format, ap2);
+	va_end(ap2);
+	if (len < 0 || !tcp_server_evict_space(ss, (size_t)len + 1))
+		return -2;
 
-	return wcount;
+	return telnet_ringbuffer_vprintf(&ss->rb_out, format, ap);
 }
 
 
-static err_t tcp_server_poll(void *arg, struct tcp_pcb *pcb)
+/* Format message directly into output buffer of session. Message is added completely or not at all. */
+static int tcp_server_vprintf(telnet_session_t *ss, const char *format, va_list ap)
 {
-	tcp_server_t *st = (tcp_server_t*)arg;
-	int wcount = 0;
+	int len;
 
+	if (ss->cstate != CS_CONNECT && ss->cstate != CS_DETACHED)
+		return ERR_CONN;
+	if ((len = tcp_server_format(ss, format, ap)) < 0)
+		return ERR_MEM;
 
-	if (st->cstate == CS_ACCEPT) {
-		if (st->login_failure_count >= MAX_LOGIN_FAILURES) {
-			LOG_MSG(LOG_NOTICE, "Too many login failures, disconnecting client: %s:%u",
-				ip4addr_ntoa(&pcb->remote_ip), pcb->remote_port);
-			close_client_connection(st->client);
-			st->client = NULL;
-			st->cstate = CS_NONE;
-			st->login[0] = 0;
-			return ERR_OK;
-		}
+	tcp_server_schedule_flush(ss);
 
-		if (st->login_delay == 0) {
-			if ((st->mode == TELNET_MODE && st->telnet_cmd_count > 0) || st->mode == RAW_MODE) {
-				st->cstate = (st->auth_cb ? CS_AUTH_LOGIN : CS_CONNECT);
-				if (st->banner && !st->banner_displayed) {
-					tcp_write(pcb, st->banner, strlen(st->banner), TCP_WRITE_FLAG_COPY);
-					st->banner_displayed = true;
-					wcount++;
-				}
-			}
+	return len;
+}
 
-			if (st->cstate == CS_AUTH_LOGIN) {
-				tcp_write(pcb, telnet_login_prompt, strlen(telnet_login_prompt), 0);
-				wcount++;
-			}
 
-		} else {
-			st->login_delay--;
-		}
+int telnet_server_vprintf(tcp_server_t *st, const char *format, va_list ap)
+{
+	telnet_session_t *first = NULL;
+	size_t offset = 0;
+	bool full = false;
+	int len = 0;
+	uint8_t *ptr;
 
-		if (wcount > 0)
-			tcp_output(pcb);
-	}
+	if (!st || !format)
+		return ERR_ARG;
 
-	if (st->auto_flush && st->cstate == CS_CONNECT) {
-		tcp_server_flush_buffer(st);
+	/* Format once (into the first session), other sessions get a copy of the result */
+	cyw43_arch_lwip_begin();
+	for_each_session(st, ss) {
+		if (ss->cstate != CS_CONNECT && ss->cstate != CS_DETACHED)
+			continue;
+		if (!first) {
+			if ((len = tcp_server_format(ss, format, ap)) < 0) {
+				full = true;
+				continue;
+			}
+			offset = telnet_ringbuffer_size(&ss->rb_out) - len;
+			first = ss;
+			continue;
+		}
+		if (!tcp_server_evict_space(ss, len)) {
+			full = true;
+			continue;
+		}
+		for (size_t i = 0; i < (size_t)len; ) {
+			size_t n = telnet_ringbuffer_peek_at(&first->rb_out, offset + i, &ptr, len - i);
+			telnet_ringbuffer_add(&ss->rb_out, ptr, n, false);
+			i += n;
+		}
+		tcp_server_schedule_flush(ss);
 	}
+	if (first)
+		tcp_server_schedule_flush(first);
+	cyw43_arch_lwip_end();
 
-	return ERR_OK;
+	if (full)
+		return ERR_MEM;
+	return (first ? len : ERR_CONN);
 }
 
 
-static void tcp_server_err(void *arg, err_t err)
+int telnet_server_printf(tcp_server_t *st, const char *format, ...)
 {
-	tcp_server_t *st = (tcp_server_t*)arg;
+	va_list ap;
+	int res;
 
-	if (err == ERR_ABRT)
-		return;
+	va_start(ap, format);
+	res = telnet_server_vprintf(st, format, ap);
+	va_end(ap);
 
-	LOG_MSG(LOG_ERR,"tcp_server_err: client connection error: %d", err);
+	return res;
 }
 
 
-static err_t tcp_server_accept(void *arg, struct tcp_pcb *pcb, err_t err)
+int telnet_server_read(tcp_server_t *st, void *buf, size_t len)
 {
-	tcp_server_t *st = (tcp_server_t*)arg;
+	size_t count = 0;
 
+	if (!st || !buf)
+		return -1;
 
-	if (!pcb || err != ERR_OK) {
-		LOG_MSG(LOG_ERR, "tcp_server_accept: failure: %d", err);
-		return ERR_VAL;
-	}
+	cyw43_arch_lwip_begin();
+	if (len > 0)
+		count = tcp_server_read_any(st, buf, len, &st->read_next);
+	cyw43_arch_lwip_end();
 
-	LOG_MSG(LOG_NOTICE, "Client connected: %s:%u",
-		ip4addr_ntoa(&pcb->remote_ip), pcb->remote_port);
+	return count;
+}
 
-	if (st->allow_connect_cb) {
-		if (st->allow_connect_cb(&pcb->remote_ip) <= 0) {
-			LOG_MSG(LOG_ERR, "tcp_server_accept: connection not allowed from: %s",
-				ip4addr_ntoa(&pcb->remote_ip));
-			return ERR_MEM;
-		}
-	}
 
-	if (st->cstate != CS_NONE) {
-		LOG_MSG(LOG_ERR, "tcp_server_accept: reject connection");
-		return ERR_MEM;
+bool telnet_server_client_connected(tcp_server_t *st)
+{
+	for_each_session(st, ss) {
+		if (ss->cstate != CS_NONE && ss->cstate != CS_DETACHED)
+			return true;
 	}
 
-	st->client = pcb;
-	tcp_arg(pcb, st);
-	tcp_sent(pcb, tcp_server_sent);
-	tcp_recv(pcb, tcp_server_recv);
-	tcp_poll(pcb, tcp_server_poll, TCP_CLIENT_POLL_TIME);
-	tcp_err(pcb, tcp_server_err);
+	return false;
+}
 
-	st->cstate = CS_ACCEPT;
-	st->telnet_state = 0;
-	st->telnet_cmd_count = 0;
-	st->login_failure_count = 0;
-	st->banner_displayed = false;
-	st->login[0] = 0;
-	telnet_ringbuffer_flush(&st->rb_in);
-	telnet_ringbuffer_flush(&st->rb_out);
 
-	if (st->mode == TELNET_MODE) { /* Send Telnet "handshake"... */
-		tcp_write(pcb, telnet_default_options, sizeof(telnet_default_options), 0);
-		tcp_output(pcb);
+err_t telnet_server_get_client_ip(const tcp_server_t *st, ip_addr_t *ip, uint16_t *port)
+{
+	/* Return address of the first connected client */
+	for_each_session(st, ss) {
+		if (telnet_session_get_client_ip(ss, ip, port) == ERR_OK)
+			return ERR_OK;
 	}
 
-	return ERR_OK;
+	return ERR_CONN;
 }
 
 
-static bool tcp_server_open(tcp_server_t *st) {
-	struct tcp_pcb *pcb;
-	err_t err;
+const char* tcp_connection_state_name(enum tcp_connection_state state)
+{
+	switch (state) {
+	case CS_NONE:
+		return "No Connection";
+	case CS_ACCEPT:
+		return "Accepted";
+	case CS_AUTH_LOGIN:
+	case CS_AUTH_PASSWD:
+		return "Authenticating";
+	case CS_CONNECT:
+		return "Connected";
+	case CS_DETACHED:
+		return "Detached";
+	}
+	return "Unknown";
+}
 
-	if (!st)
-		return false;
 
-	if (!(pcb = tcp_new_ip_type(IPADDR_TYPE_ANY))) {
-		LOG_MSG(LOG_ERR, "tcp_server_open: failed to create pcb");
-		return false;
-	}
+err_t telnet_server_disconnect_client(tcp_server_t *st)
+{
+	err_t res = ERR_OK;
 
-	if ((err = tcp_bind(pcb, NULL, st->port)) != ERR_OK) {
-		LOG_MSG(LOG_ERR, "tcp_server_open: cannot bind to port %d: %d", st->port, err);
-		tcp_abort(pcb);
-		return false;
+	for_each_session(st, ss) {
+		err_t err = telnet_session_disconnect(ss);
+		if (err != ERR_OK)
+			res = err;
 	}
 
-	if (!(st->listen = tcp_listen_with_backlog(pcb, TCP_SERVER_MAX_CONN))) {
-		LOG_MSG(LOG_ERR, "tcp_server_open: failed to listen on port %d", st->port);
-		tcp_abort(pcb);
-		return false;
-	}
+	return res;
+}
 
-	tcp_arg(st->listen, st);
-	tcp_accept(st->listen, tcp_server_accept);
 
-	return true;
+telnet_session_t* telnet_server_get_session(tcp_server_t *st, uint8_t index)
+{
+	if (!st || index >= st->max_sessions)
+		return NULL;
+
+	return &st->sessions[index];
 }
 
 
-static void stdio_tcp_out_chars(const char *buf, int length)
+err_t telnet_session_flush_buffer(telnet_session_t *ss)
 {
-	int count = 0;
+	cyw43_arch_lwip_begin();
+	err_t res = tcp_server_flush_buffer(ss);
+	cyw43_arch_lwip_end();
 
-	if (!stdio_tcpserv)
-		return;
-	if (stdio_tcpserv->cstate != CS_CONNECT)
-		return;
+	return res;
+}
+
+
+err_t telnet_session_write(telnet_session_t *ss, const void *buf, size_t len)
+{
+	err_t res;
+
+	if (!ss || !buf)
+		return ERR_ARG;
 
 	cyw43_arch_lwip_begin();
-	for (int i = 0; i <length; i++) {
-		if (telnet_ringbuffer_add_char(&stdio_tcpserv->rb_out, buf[i], false) < 0)
-			break;
-		count++;
-	}
-	if (count > 0)
-		tcp_server_flush_buffer(stdio_tcpserv);
+	res = tcp_server_write(ss, buf, len);
 	cyw43_arch_lwip_end();
+
+	return res;
 }
 
 
-static int stdio_tcp_in_chars(char *buf, int length)
+err_t telnet_session_writev(telnet_session_t *ss, const telnet_iovec_t *iov, int iovcnt)
 {
-	int i = 0;
-	int c;
+	err_t res;
 
-	if (!stdio_tcpserv)
-		return PICO_ERROR_NO_DATA;
-	if (stdio_tcpserv->cstate != CS_CONNECT)
-		return PICO_ERROR_NO_DATA;
+	if (!ss || !iov || iovcnt < 0)
+		return ERR_ARG;
 
 	cyw43_arch_lwip_begin();
-	while (i < length && ((c = telnet_ringbuffer_read_char(&stdio_tcpserv->rb_in)) >= 0)) {
-		//printf("'%c' (%02x / %u)\n", isprint(c) ? c : '.', c, c);
-		buf[i++] = c;
-	}
+	res = tcp_server_writev(ss, iov, iovcnt);
 	cyw43_arch_lwip_end();
 
-	return i ? i : PICO_ERROR_NO_DATA;
+	return res;
 }
 
 
-static void stdio_tcp_set_chars_available_callback(void (*fn)(void*), void *param)
+int telnet_session_read(telnet_session_t *ss, void *buf, size_t len)
 {
-    chars_available_callback = fn;
-    chars_available_param = param;
-}
+	size_t count = 0;
 
+	if (!ss || !buf)
+		return -1;
 
-stdio_driver_t stdio_tcp_driver = {
-	.out_chars = stdio_tcp_out_chars,
-	.in_chars = stdio_tcp_in_chars,
-	.set_chars_available_callback = stdio_tcp_set_chars_available_callback,
-	.crlf_enabled = PICO_STDIO_DEFAULT_CRLF
-};
+	cyw43_arch_lwip_begin();
+	if (len > 0)
+		count = tcp_server_read_input(ss, buf, len);
+	cyw43_arch_lwip_end();
+
+	return count;
+}
 
 
-static void stdio_tcp_init(tcp_server_t *st)
+size_t telnet_session_peek(telnet_session_t *ss, const uint8_t **ptr)
 {
-	stdio_tcpserv = st;
-	chars_available_callback = NULL;
-	chars_available_param = NULL;
-	stdio_set_driver_enabled(&stdio_tcp_driver, true);
+	size_t len = 0;
+	uint8_t *rbuf;
+
+	if (!ss || !ptr)
+		return 0;
+
+	*ptr = NULL;
+	cyw43_arch_lwip_begin();
+	if (telnet_ringbuffer_size(&ss->rb_in) > 0) {
+		len = telnet_ringbuffer_peek(&ss->rb_in, &rbuf, ss->rb_in.size);
+		*ptr = rbuf;
+	}
+	else if (ss->server->rx_zero_copy && ss->cstate == CS_CONNECT && ss->rx_queue) {
+		*ptr = ss->rx_queue->payload;
+		len = ss->rx_queue->len;
+	}
+	cyw43_arch_lwip_end();
+
+	return len;
 }
 
 
-static void stdio_tcp_close(tcp_server_t *st)
+void telnet_session_consume(telnet_session_t *ss, size_t len)
 {
-	if (!stdio_tcpserv || stdio_tcpserv != st)
+	size_t consumed;
+
+	if (!ss || len < 1)
 		return;
-	stdio_set_driver_enabled(&stdio_tcp_driver, false);
-	stdio_tcpserv = NULL;
-	chars_available_callback = NULL;
-	chars_available_param = NULL;
+
+	cyw43_arch_lwip_begin();
+	if (telnet_ringbuffer_size(&ss->rb_in) > 0) {
+		telnet_ringbuffer_read(&ss->rb_in, NULL, len);
+	}
+	else if (ss->server->rx_zero_copy && ss->cstate == CS_CONNECT) {
+		if ((consumed = rx_queue_consume(ss, len)) > 0 && ss->client)
+			tcp_server_recved(ss->client, consumed);
+	}
+	work_begin(ss->server);
+	tcp_server_process_input(ss);
+	cyw43_arch_lwip_end();
 }
 
 
-tcp_server_t* telnet_server_init(size_t rxbuf_size, size_t txbuf_size)
+bool telnet_session_connected(telnet_session_t *ss)
 {
-	return tcp_server_init(rxbuf_size > 0 ? rxbuf_size : 2048,
-			txbuf_size > 0 ? txbuf_size : 2048);
+	return (ss && ss->cstate == CS_CONNECT);
 }
 
 
-bool telnet_server_start(tcp_server_t *st, bool stdio)
+int telnet_session_vprintf(telnet_session_t *ss, const char *format, va_list ap)
 {
+	int res;
+
+	if (!ss || !format)
+		return ERR_ARG;
+
 	cyw43_arch_lwip_begin();
-	bool res = tcp_server_open(st);
-	if (!res) {
-		tcp_server_close(st);
-	} else {
-		if (stdio)
-			stdio_tcp_init(st);
-	}
+	res = tcp_server_vprintf(ss, format, ap);
 	cyw43_arch_lwip_end();
 
 	return res;
 }
 
 
-void telnet_server_destroy(tcp_server_t *st)
+int telnet_session_printf(telnet_session_t *ss, const char *format, ...)
 {
-	cyw43_arch_lwip_begin();
-	stdio_tcp_close(st);
-	tcp_server_close(st);
-	cyw43_arch_lwip_end();
-	telnet_ringbuffer_free(&st->rb_in);
-	telnet_ringbuffer_free(&st->rb_out);
+	va_list ap;
+	int res;
+
+	va_start(ap, format);
+	res = telnet_session_vprintf(ss, format, ap);
+	va_end(ap);
+
+	return res;
 }
 
 
-err_t telnet_server_flush_buffer(tcp_server_t *st)
+err_t telnet_session_get_client_ip(const telnet_session_t *ss, ip_addr_t *ip, uint16_t *port)
 {
+	err_t res = ERR_CONN;
+
 	cyw43_arch_lwip_begin();
-	err_t res = tcp_server_flush_buffer(st);
+	if (ss->cstate != CS_NONE && ss->client) {
+		if (ip)
+			ip_addr_set(ip, &ss->client->remote_ip);
+		if (port)
+			*port = ss->client->remote_port;
+		res = ERR_OK;
+	}
 	cyw43_arch_lwip_end();
 
 	return res;
 }
 
 
-bool telnet_server_client_connected(tcp_server_t *st)
-{
-	return (st->cstate == CS_NONE ? false : true);
-}
-
-
-err_t telnet_server_get_client_ip(const tcp_server_t *st, ip_addr_t *ip, uint16_t *port)
+err_t telnet_session_disconnect(telnet_session_t *ss)
 {
-	if (st->cstate == CS_NONE || !st->client)
-		return ERR_CONN;
+	tcp_server_t *st = ss->server;
+	err_t res = ERR_OK;
+	ip_addr_t ip;
+	uint16_t port;
 
 	cyw43_arch_lwip_begin();
-	if (ip)
-		ip_addr_set(ip, &st->client->remote_ip);
-	if (port)
-		*port = st->client->remote_port;
+	if (ss->client) {
+		ip_addr_set(&ip, &ss->client->remote_ip);
+		port = ss->client->remote_port;
+		res = close_client_connection(ss->client);
+		LOG_MSG(LOG_NOTICE,"Client disconnected: %s:%u", ip4addr_ntoa(&ip), port);
+	}
+	tcp_server_release_client(ss);
 	cyw43_arch_lwip_end();
 
-	return ERR_OK;
+	return res;
 }
 
 
-const char* tcp_connection_state_name(enum tcp_connection_state state)
+#ifndef TELNETD_NO_SCREEN
+typedef struct screen_ctx_t {
+	telnet_session_t *ss;
+	size_t queued;            /* Output of current render in rb_out */
+	bool evicted;
+} screen_ctx_t;
+
+
+static bool screen_out(void *ctx, const uint8_t *buf, size_t len)
 {
-	switch (state) {
-	case CS_NONE:
-		return "No Connection";
-	case CS_ACCEPT:
-		return "Accepted";
-	case CS_AUTH_LOGIN:
-	case CS_AUTH_PASSWD:
-		return "Authenticating";
-	case CS_CONNECT:
-		return "Connected";
+	screen_ctx_t *sc = (screen_ctx_t*)ctx;
+	telnet_ringbuffer_t *rb = &sc->ss->rb_out;
+
+	/* With OVERFLOW_EVICT, drop output queued before this render to make room. Output of
+	   this render is not evicted for itself, rest of the changes are sent on next render. */
+	if (rb->free < len && telnet_ringbuffer_size(rb) > sc->queued
+		&& sc->ss->server->overflow_mode == OVERFLOW_EVICT) {
+		if (!tcp_server_evict_space(sc->ss, len))
+			return false;
+		sc->evicted = true;
+		if (sc->queued > telnet_ringbuffer_size(rb))
+			sc->queued = telnet_ringbuffer_size(rb);
 	}
-	return "Unknown";
+	if (telnet_ringbuffer_add(rb, buf, len, false) < 0)
+		return false;
+	sc->queued += len;
+
+	return true;
 }
 
 
-err_t telnet_server_disconnect_client(tcp_server_t *st)
+/* Send changes in screen to the session. Returns number of cells that did not fit in
+   output buffer (these are sent on next call), or -1 if session is not connected. */
+int telnet_session_render(telnet_session_t *ss, telnet_screen_t *screen)
 {
-	err_t res = ERR_OK;
-	ip_addr_t ip;
-	uint16_t port;
+	int res = -1;
 
-	if (st->client) {
-		cyw43_arch_lwip_begin();
-		ip_addr_set(&ip, &st->client->remote_ip);
-		port = st->client->remote_port;
-		res = close_client_connection(st->client);
-		st->client = NULL;
-		cyw43_arch_lwip_end();
-		LOG_MSG(LOG_NOTICE,"Client disconnected: %s:%u", ip4addr_ntoa(&ip), port);
+	if (!ss || !screen)
+		return -1;
+
+	cyw43_arch_lwip_begin();
+	if (ss->cstate == CS_CONNECT || ss->cstate == CS_DETACHED) {
+		screen_ctx_t sc = { ss, 0, false };
+
+		res = telnet_screen_render(screen, screen_out, &sc);
+		/* Dropped output may have included earlier changes, repaint everything on next render */
+		if (sc.evicted)
+			telnet_screen_invalidate(screen);
+		tcp_server_schedule_flush(ss);
 	}
-	st->cstate = CS_NONE;
-	st->login[0] = 0;
+	cyw43_arch_lwip_end();
 
 	return res;
 }
+#endif
 
 /* eof :-)  */
@@ -14,6 +14,12 @@
 #include <sys/param.h>
 #include <sys/types.h>
 
+#include "pico_telnetd/alloc.h"
+
+#ifdef TELNETD_STATIC_ALLOC
+#pragma GCC poison malloc calloc realloc
+#endif
+
 extern void *mempcpy(void *dst, const void *src, size_t len);
 
 
@@ -607,6 +613,13 @@ sha512_crypt (const char *key, const char *salt)
      password.  We can compute an upper bound for the size of the
      result in advance and so we can prepare the buffer we pass to
      `sha512_crypt_r'.  */
+#ifdef TELNETD_STATIC_ALLOC
+  /* Fixed size buffer large enough for longest possible result. */
+  static char buffer[sizeof (sha512_salt_prefix) - 1
+		     + sizeof (sha512_rounds_prefix) + 9 + 1
+		     + SALT_LEN_MAX + 1 + 86 + 1];
+  int buflen = sizeof (buffer);
+#else
   static char *buffer;
   static int buflen;
   int needed = (sizeof (sha512_salt_prefix) - 1
@@ -615,13 +628,16 @@ sha512_crypt (const char *key, const char *salt)
 
   if (buflen < needed)
     {
-      char *new_buffer = (char *) realloc (buffer, needed);
+      /* Previous result does not need to be preserved. */
+      char *new_buffer = (char *) telnetd_alloc (needed, 1, TELNETD_ALLOC_CRYPT);
       if (new_buffer == NULL)
 	return NULL;
+      telnetd_free (buffer, buflen, TELNETD_ALLOC_CRYPT);
 
       buffer = new_buffer;
       buflen = needed;
     }
+#endif
 
   return sha512_crypt_r (key, salt, buffer, buflen);
 }
@@ -0,0 +1,44 @@
+/* test.h
+   Copyright (C) 2024 Timo Kokkonen <tjko@iki.fi>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+
+   This file is part of pico-telnetd Library.
+
+   pico-telnetd Library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   pico-telnetd Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with pico-telnetd Library. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PICO_TELNETD_TEST_H
+#define PICO_TELNETD_TEST_H 1
+
+#include <stdio.h>
+
+/* Minimal check macro for host tests: report failure and keep going. */
+static int test_failures = 0;
+
+#define CHECK(cond) do {						\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: check failed: %s\n",	\
+				__FILE__, __LINE__, #cond);		\
+			test_failures++;				\
+		}							\
+	} while (0)
+
+static inline int test_result(void)
+{
+	return (test_failures > 0 ? 1 : 0);
+}
+
+#endif /* PICO_TELNETD_TEST_H */
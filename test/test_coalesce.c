@@ -0,0 +1,105 @@
+/* test_coalesce.c
+   Copyright (C) 2024 Timo Kokkonen <tjko@iki.fi>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+
+   This file is part of pico-telnetd Library.
+
+   pico-telnetd Library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   pico-telnetd Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with pico-telnetd Library. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pico_telnetd/ringbuffer.h"
+#include "pico_telnetd/coalesce.h"
+#include "test.h"
+
+
+static telnet_ringbuffer_t rb;
+static uint8_t buf[64];
+
+static telnet_ringbuffer_t* set(const char *s)
+{
+	telnet_ringbuffer_init(&rb, buf, sizeof(buf));
+	telnet_ringbuffer_add(&rb, (const uint8_t*)s, strlen(s), false);
+	return &rb;
+}
+
+
+static void test_home(void)
+{
+	const char *home[] = { "\x1b[H\x1b[2J", "\x1b[f\x1b[J", "\x1b[1H\x1b[0J", "\x1b[1;1H\x1b[2J",
+			       "\x1b[;1H\x1b[2J", "\x1b[1;H\x1b[2J", "\x1b[;H\x1b[2J", "\x1b[1;1f\x1b[2J",
+			       "\x1b[H\x1b[0m\x1b[2J", "\x1b[H\x1b[m\x1b[J" };
+
+	for (size_t i = 0; i < sizeof(home) / sizeof(home[0]); i++) {
+		CHECK(telnet_coalesce_find_home(set(home[i]), 0) == 0);
+	}
+	CHECK(telnet_coalesce_find_home(set("abc\x1b[H\x1b[2Jdef"), 0) == 3);
+	CHECK(telnet_coalesce_find_home(set("abc\x1b[H\x1b[2Jdef"), 4) == -1);
+	CHECK(telnet_coalesce_find_home(set("\x1b[H\x1b[2J"), 1) == -1);
+	/* Incomplete sequence */
+	CHECK(telnet_coalesce_find_home(set("\x1b[1;1"), 0) == -1);
+	CHECK(telnet_coalesce_find_home(set("\x1b[H\x1b[2"), 0) == -1);
+}
+
+
+/* Cursor moves elsewhere must not be mistaken for cursor home. */
+static void test_not_home(void)
+{
+	const char *moves[] = { "\x1b[10;10H", "\x1b[11H", "\x1b[1;10H", "\x1b[10;1H", "\x1b[0;0H",
+				"\x1b[01;01H", "\x1b[1;1;1H", "\x1b[1A", "\x1b[2J", "\x1b[11f" };
+
+	for (size_t i = 0; i < sizeof(moves) / sizeof(moves[0]); i++) {
+		CHECK(telnet_coalesce_find_home(set(moves[i]), 0) == -1);
+	}
+
+	/* Cursor home without erase is just a cursor move (to top left cell) */
+	CHECK(telnet_coalesce_find_home(set("\x1b[Habc"), 0) == -1);
+	CHECK(telnet_coalesce_find_home(set("\x1b[1HA\x1b[6;11HY\x1b[1HB"), 0) == -1);
+	CHECK(telnet_coalesce_find_home(set("\x1b[H\x1b[1mA"), 0) == -1);
+	CHECK(telnet_coalesce_find_home(set("\x1b[10;10H\x1b[2J"), 0) == -1);
+
+	/* Frame followed by an update elsewhere on the screen is not superseded */
+	set("\x1b[H\x1b[Jframe1\x1b[10;10Hupd");
+	CHECK(telnet_coalesce_find_home(&rb, 0) == 0);
+	CHECK(telnet_coalesce_find_home(&rb, 1) == -1);
+
+	/* Screen renderer output (cursor moves) between two redraws */
+	set("\x1b[H\x1b[Jone\x1b[3;5Hx\x1b[2Hy\x1b[1Hz\x1b[1;1H\x1b[Jtwo");
+	CHECK(telnet_coalesce_find_home(&rb, 1) == 26);
+}
+
+
+static void test_cr_frame(void)
+{
+	CHECK(telnet_coalesce_cr_frame(set("12%\r13%\r"), 0) == 4);
+	CHECK(telnet_coalesce_cr_frame(set("12%\r13%\r"), 4) == 0);
+	CHECK(telnet_coalesce_cr_frame(set("12%\r\n13%"), 0) == 0);
+	CHECK(telnet_coalesce_cr_frame(set("line\n12%\r"), 0) == 0);
+}
+
+
+int main(void)
+{
+	test_home();
+	test_not_home();
+	test_cr_frame();
+
+	return test_result();
+}
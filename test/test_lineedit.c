@@ -0,0 +1,125 @@
+/* test_lineedit.c
+   Copyright (C) 2024 Timo Kokkonen <tjko@iki.fi>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+
+   This file is part of pico-telnetd Library.
+
+   pico-telnetd Library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   pico-telnetd Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with pico-telnetd Library. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pico_telnetd/lineedit.h"
+#include "test.h"
+
+
+static void out(void *ctx, const uint8_t *buf, size_t len)
+{
+	(void)ctx;
+	(void)buf;
+	(void)len;
+}
+
+
+/* Feed string to editor, returns number of lines completed (and accepted). */
+static int feed(telnet_lineedit_t *le, const char *s)
+{
+	int lines = 0;
+
+	for (; *s; s++) {
+		if (telnet_lineedit_input(le, (uint8_t)*s, out, NULL) == TELNET_LINEEDIT_LINE) {
+			telnet_lineedit_accept(le);
+			lines++;
+		}
+	}
+
+	return lines;
+}
+
+
+static bool line_is(telnet_lineedit_t *le, const char *s)
+{
+	return (le->len == strlen(s) && !memcmp(le->line, s, le->len));
+}
+
+
+static void test_edit(void)
+{
+	telnet_lineedit_t le;
+
+	CHECK(telnet_lineedit_init(&le, NULL, 16, 32) == 0);
+	CHECK(feed(&le, "hello") == 0);
+	CHECK(line_is(&le, "hello"));
+	CHECK(feed(&le, "\x1b[D\x1b[DX") == 0);
+	CHECK(line_is(&le, "helXlo"));
+	CHECK(feed(&le, "\x7f\x01\x0b") == 0);
+	CHECK(line_is(&le, ""));
+	/* Line is limited to line_size */
+	CHECK(feed(&le, "12345678901234567890") == 0);
+	CHECK(le.len == 16);
+	telnet_lineedit_free(&le);
+}
+
+
+/* History buffer that is filled exactly to its size. */
+static void test_history_full(void)
+{
+	telnet_lineedit_t le;
+
+	CHECK(telnet_lineedit_init(&le, NULL, 16, 8) == 0);
+	CHECK(feed(&le, "abc\rxyz\r") == 2);
+	CHECK(le.history.free == 0);
+
+	/* Older entries are found even when buffer is full */
+	CHECK(feed(&le, "\x10") == 0);
+	CHECK(line_is(&le, "xyz"));
+	CHECK(feed(&le, "\x10") == 0);
+	CHECK(line_is(&le, "abc"));
+	CHECK(feed(&le, "\x10") == 0);
+	CHECK(line_is(&le, "abc"));
+	CHECK(feed(&le, "\x0e\x0e") == 0);
+	CHECK(line_is(&le, ""));
+
+	/* Adding to full history drops oldest entries (used to loop forever) */
+	CHECK(feed(&le, "12\r") == 1);
+	CHECK(feed(&le, "\x10") == 0);
+	CHECK(line_is(&le, "12"));
+	CHECK(feed(&le, "\x10") == 0);
+	CHECK(line_is(&le, "xyz"));
+	CHECK(feed(&le, "\x15") == 0);
+
+	/* Line that fills the whole history */
+	CHECK(feed(&le, "1234567\r") == 1);
+	CHECK(le.history.free == 0);
+	CHECK(feed(&le, "\x10\x10") == 0);
+	CHECK(line_is(&le, "1234567"));
+	CHECK(feed(&le, "\x15" "abcdefgh\r") == 1);
+	CHECK(feed(&le, "\x10") == 0);
+	CHECK(line_is(&le, "1234567"));
+	telnet_lineedit_free(&le);
+}
+
+
+int main(void)
+{
+	test_edit();
+	test_history_full();
+
+	return test_result();
+}
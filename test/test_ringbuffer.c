@@ -0,0 +1,165 @@
+/* test_ringbuffer.c
+   Copyright (C) 2024 Timo Kokkonen <tjko@iki.fi>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+
+   This file is part of pico-telnetd Library.
+
+   pico-telnetd Library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   pico-telnetd Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with pico-telnetd Library. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pico_telnetd/ringbuffer.h"
+#include "test.h"
+
+
+/* Buffer that is exactly full has head == tail, same as an empty one. */
+static void test_full_buffer(void)
+{
+	telnet_ringbuffer_t rb;
+	uint8_t buf[8];
+	uint8_t out[8];
+
+	telnet_ringbuffer_init(&rb, buf, sizeof(buf));
+	CHECK(telnet_ringbuffer_peek_char(&rb, 0) == -2);
+	CHECK(telnet_ringbuffer_read_char(&rb) == -2);
+
+	/* Wrap around first, so that head and tail are not at the start */
+	CHECK(telnet_ringbuffer_add(&rb, (const uint8_t*)"xyz", 3, false) == 0);
+	CHECK(telnet_ringbuffer_read(&rb, NULL, 3) == 0);
+	CHECK(telnet_ringbuffer_add(&rb, (const uint8_t*)"abcdefgh", 8, false) == 0);
+	CHECK(rb.free == 0 && rb.head == rb.tail);
+	CHECK(telnet_ringbuffer_size(&rb) == 8);
+
+	CHECK(telnet_ringbuffer_peek_char(&rb, 0) == 'a');
+	CHECK(telnet_ringbuffer_peek_char(&rb, 7) == 'h');
+	CHECK(telnet_ringbuffer_peek_char(&rb, 8) == -3);
+	CHECK(telnet_ringbuffer_add_char(&rb, 'i', false) == -2);
+
+	CHECK(telnet_ringbuffer_read_char(&rb) == 'a');
+	CHECK(telnet_ringbuffer_size(&rb) == 7);
+	CHECK(telnet_ringbuffer_read(&rb, out, 7) == 0);
+	CHECK(!memcmp(out, "bcdefgh", 7));
+	CHECK(telnet_ringbuffer_read_char(&rb) == -2);
+}
+
+
+static void test_overwrite(void)
+{
+	telnet_ringbuffer_t rb;
+	uint8_t buf[4];
+
+	telnet_ringbuffer_init(&rb, buf, sizeof(buf));
+	for (int i = 0; i < 6; i++)
+		CHECK(telnet_ringbuffer_add_char(&rb, '0' + i, true) == 0);
+	CHECK(telnet_ringbuffer_size(&rb) == 4);
+	for (int i = 2; i < 6; i++)
+		CHECK(telnet_ringbuffer_read_char(&rb) == '0' + i);
+	CHECK(telnet_ringbuffer_read_char(&rb) == -2);
+}
+
+
+static void test_prepend(void)
+{
+	telnet_ringbuffer_t rb;
+	uint8_t buf[8];
+	uint8_t out[8];
+
+	telnet_ringbuffer_init(&rb, buf, sizeof(buf));
+	CHECK(telnet_ringbuffer_add(&rb, (const uint8_t*)"defgh", 5, false) == 0);
+	CHECK(telnet_ringbuffer_prepend(&rb, (const uint8_t*)"abcd", 4) == -3);
+	CHECK(telnet_ringbuffer_prepend(&rb, (const uint8_t*)"abc", 3) == 0);
+	CHECK(rb.free == 0);
+	CHECK(telnet_ringbuffer_peek_char(&rb, 0) == 'a');
+	CHECK(telnet_ringbuffer_read(&rb, out, 8) == 0);
+	CHECK(!memcmp(out, "abcdefgh", 8));
+}
+
+
+static int rb_printf(telnet_ringbuffer_t *rb, const char *format, ...)
+{
+	va_list ap;
+	int res;
+
+	va_start(ap, format);
+	res = telnet_ringbuffer_vprintf(rb, format, ap);
+	va_end(ap);
+
+	return res;
+}
+
+
+/* Message is formatted in place, and needs room for the terminating NUL too. */
+static void test_vprintf(void)
+{
+	telnet_ringbuffer_t rb;
+	uint8_t buf[16];
+	uint8_t out[16];
+
+	telnet_ringbuffer_init(&rb, buf, sizeof(buf));
+	CHECK(rb_printf(&rb, "%s=%d", "abc", 42) == 6);
+	CHECK(telnet_ringbuffer_size(&rb) == 6);
+	CHECK(telnet_ringbuffer_read(&rb, out, 6) == 0);
+	CHECK(!memcmp(out, "abc=42", 6));
+
+	/* Exactly free bytes does not fit (NUL), free - 1 does */
+	telnet_ringbuffer_init(&rb, buf, 8);
+	CHECK(rb_printf(&rb, "%s", "12345678") == -2);
+	CHECK(telnet_ringbuffer_size(&rb) == 0);
+	CHECK(rb_printf(&rb, "%s", "1234567") == 7);
+	CHECK(rb.free == 1);
+	CHECK(rb_printf(&rb, "%s", "") == -2);
+
+	/* Free space wraps around: data is moved to the start of the buffer */
+	telnet_ringbuffer_init(&rb, buf, sizeof(buf));
+	CHECK(telnet_ringbuffer_add(&rb, (const uint8_t*)"xxxxxxxxxxab", 12, false) == 0);
+	CHECK(telnet_ringbuffer_read(&rb, NULL, 10) == 0);
+	CHECK(rb.free == 14 && rb.size - rb.tail == 4);
+	CHECK(rb_printf(&rb, "%d%s", 12345, "6789") == 9);
+	CHECK(telnet_ringbuffer_size(&rb) == 11);
+	CHECK(telnet_ringbuffer_read(&rb, out, 11) == 0);
+	CHECK(!memcmp(out, "ab123456789", 11));
+
+	/* Wrapping free space, message of exactly free bytes is rejected, buffer is not changed... */
+	telnet_ringbuffer_init(&rb, buf, sizeof(buf));
+	CHECK(telnet_ringbuffer_add(&rb, (const uint8_t*)"xxxxxxxxxxab", 12, false) == 0);
+	CHECK(telnet_ringbuffer_read(&rb, NULL, 10) == 0);
+	CHECK(rb_printf(&rb, "%s", "0123456789abcd") == -2);
+	CHECK(telnet_ringbuffer_size(&rb) == 2);
+	CHECK(telnet_ringbuffer_peek_char(&rb, 0) == 'a' && telnet_ringbuffer_peek_char(&rb, 1) == 'b');
+
+	/* ...and free - 1 bytes fills the buffer (except for one byte) */
+	CHECK(rb_printf(&rb, "%s", "0123456789abc") == 13);
+	CHECK(rb.free == 1);
+	CHECK(telnet_ringbuffer_read(&rb, out, 15) == 0);
+	CHECK(!memcmp(out, "ab0123456789abc", 15));
+	CHECK(telnet_ringbuffer_size(&rb) == 0);
+}
+
+
+int main(void)
+{
+	test_full_buffer();
+	test_overwrite();
+	test_prepend();
+	test_vprintf();
+
+	return test_result();
+}
@@ -0,0 +1,166 @@
+/* test_screen.c
+   Copyright (C) 2024 Timo Kokkonen <tjko@iki.fi>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+
+   This file is part of pico-telnetd Library.
+
+   pico-telnetd Library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   pico-telnetd Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with pico-telnetd Library. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pico_telnetd/ringbuffer.h"
+#include "pico_telnetd/coalesce.h"
+#include "pico_telnetd/screen.h"
+#include "test.h"
+
+
+static telnet_ringbuffer_t rb;
+static uint8_t rbuf[1024];
+static char text[sizeof(rbuf) + 1];
+
+
+static bool out(void *ctx, const uint8_t *buf, size_t len)
+{
+	return (telnet_ringbuffer_add((telnet_ringbuffer_t*)ctx, buf, len, false) == 0);
+}
+
+
+/* Queued output as string */
+static const char* queued(void)
+{
+	size_t len = telnet_ringbuffer_size(&rb);
+
+	for (size_t i = 0; i < len; i++)
+		text[i] = telnet_ringbuffer_peek_char(&rb, i);
+	text[len] = 0;
+
+	return text;
+}
+
+
+static void test_render(void)
+{
+	telnet_screen_t scr;
+
+	telnet_ringbuffer_init(&rb, rbuf, sizeof(rbuf));
+	CHECK(telnet_screen_init(&scr, 20, 5, NULL) == 0);
+
+	/* First render clears the screen */
+	CHECK(telnet_screen_render(&scr, out, &rb) == 0);
+	CHECK(!strcmp(queued(), "\x1b[H\x1b[0m\x1b[2J"));
+	CHECK(telnet_coalesce_find_home(&rb, 0) == 0);
+
+	/* Nothing changed */
+	telnet_ringbuffer_flush(&rb);
+	CHECK(telnet_screen_render(&scr, out, &rb) == 0);
+	CHECK(telnet_ringbuffer_size(&rb) == 0);
+
+	/* Only changed cells are sent */
+	CHECK(telnet_screen_print(&scr, 3, 2, "ab") == 2);
+	CHECK(telnet_screen_render(&scr, out, &rb) == 0);
+	CHECK(!strcmp(queued(), "\x1b[3;4Hab"));
+	telnet_ringbuffer_flush(&rb);
+	telnet_screen_set_attr(&scr, TELNET_SCREEN_BOLD, TELNET_SCREEN_COLOR(2, 0));
+	CHECK(telnet_screen_print(&scr, 4, 2, "X") == 1);
+	CHECK(telnet_screen_render(&scr, out, &rb) == 0);
+	CHECK(!strcmp(queued(), "\b\x1b[1;31mX"));
+	telnet_ringbuffer_flush(&rb);
+
+	/* Text is clipped at end of row */
+	telnet_screen_set_attr(&scr, 0, 0);
+	CHECK(telnet_screen_print(&scr, 18, 0, "xyz") == 2);
+	CHECK(telnet_screen_print(&scr, 20, 0, "x") == -1);
+
+	telnet_screen_free(&scr);
+}
+
+
+/* Changes that do not fit are sent on next render */
+static void test_pending(void)
+{
+	telnet_screen_t scr;
+	uint8_t small[12];
+
+	CHECK(telnet_screen_init(&scr, 20, 5, NULL) == 0);
+	telnet_ringbuffer_init(&rb, small, sizeof(small));
+	CHECK(telnet_screen_render(&scr, out, &rb) == 0);
+	telnet_ringbuffer_flush(&rb);
+
+	CHECK(telnet_screen_print(&scr, 0, 1, "a") == 1);
+	CHECK(telnet_screen_print(&scr, 10, 3, "b") == 1);
+	CHECK(telnet_screen_print(&scr, 10, 4, "c") == 1);
+	CHECK(telnet_screen_render(&scr, out, &rb) == 1);
+	CHECK(!strcmp(queued(), "\r\na\x1b[4;11Hb"));
+	telnet_ringbuffer_flush(&rb);
+	CHECK(telnet_screen_render(&scr, out, &rb) == 0);
+	CHECK(!strcmp(queued(), "\x1b[B\bc"));
+
+	telnet_screen_free(&scr);
+}
+
+
+/* Screen updates queued for slow client must not be mistaken for redraws (COALESCE_CR_HOME) */
+static void test_coalesce(void)
+{
+	telnet_screen_t scr;
+	int o, skip = 0;
+
+	telnet_ringbuffer_init(&rb, rbuf, sizeof(rbuf));
+	CHECK(telnet_screen_init(&scr, 20, 10, NULL) == 0);
+	telnet_screen_print(&scr, 15, 8, "X");
+	CHECK(telnet_screen_render(&scr, out, &rb) == 0);
+	telnet_ringbuffer_flush(&rb);
+
+	/* Updates to top left cell move cursor home (without erase) */
+	telnet_screen_print(&scr, 0, 0, "A");
+	CHECK(telnet_screen_render(&scr, out, &rb) == 0);
+	telnet_screen_print(&scr, 10, 5, "Y");
+	CHECK(telnet_screen_render(&scr, out, &rb) == 0);
+	telnet_screen_print(&scr, 0, 0, "B");
+	CHECK(telnet_screen_render(&scr, out, &rb) == 0);
+	CHECK(!strcmp(queued(), "\x1b[1HA\x1b[6;11HY\x1b[1HB"));
+	CHECK(telnet_coalesce_find_home(&rb, 0) == -1);
+	CHECK(telnet_coalesce_find_home(&rb, 1) == -1);
+
+	/* Full repaints can be skipped, last one has all the cells */
+	telnet_screen_invalidate(&scr);
+	CHECK(telnet_screen_render(&scr, out, &rb) == 0);
+	telnet_screen_print(&scr, 1, 1, "Z");
+	telnet_screen_invalidate(&scr);
+	CHECK(telnet_screen_render(&scr, out, &rb) == 0);
+	CHECK(telnet_coalesce_find_home(&rb, 0) == 18);
+	while ((o = telnet_coalesce_find_home(&rb, skip + 1)) > 0)
+		skip = o;
+	CHECK(skip > 18);
+	telnet_ringbuffer_read(&rb, NULL, skip);
+	CHECK(!strcmp(queued(), "\x1b[H\x1b[0m\x1b[2JB\x1b[BZ\x1b[6;11HY\x1b[9;16HX"));
+
+	telnet_screen_free(&scr);
+}
+
+
+int main(void)
+{
+	test_render();
+	test_pending();
+	test_coalesce();
+
+	return test_result();
+}